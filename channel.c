@@ -19,11 +19,50 @@
 
 #include "psdparse.h"
 
+// Fetch n bytes of RLE data at file offset pos into the buffer *buf.
+// If the file is in memory, *buf is instead pointed at the data.
+// Returns the number of bytes available.
+
+static psd_pixels_t readrle(psd_file_t psd, unsigned char **buf, psd_bytes_t n, psd_bytes_t pos){
+#ifndef PSDPARSE_PLUGIN
+	unsigned char *p;
+	size_t got;
+
+	if( (p = psd_preadptr(psd, n, pos, &got)) ){
+		*buf = p;
+		return got;
+	}
+#endif
+	return psd_pread(psd, *buf, n, pos);
+}
+
+// Warn about, and pad, a row which could not be completely read.
+
+static void padrow(struct channel_info *chan, unsigned char *inrow, psd_pixels_t n){
+	if(n < chan->rowbytes){
+		warn_msg("row data short (wanted %d, got %d bytes)", chan->rowbytes, n);
+		// zero out unwritten part of row
+		memset(inrow + n, 0xff, chan->rowbytes - n);
+	}
+}
+
+// File position of an RLE row's data (row == rows gives the end of the last).
+
+static psd_bytes_t rowstart(struct channel_info *chan, psd_pixels_t row){
+	struct row_index *x = chan->rowpos;
+
+	return x->base[row / ROWSTEP] + (x->off16 ? x->off16[row] : x->off32[row]);
+}
+
 // Read one row's data from the PSD file, according to the parameters:
 //   chan   - points to the channel info struct
 //   row    - row index
 //   inrow  - destination for uncompressed row data (at least rowbytes in size)
 //   rlebuf - temporary buffer for RLE decompression (at least 2*rowbytes in size)
+// Uses positional reads only, so the file position is not changed, and
+// several threads may call this concurrently with their own buffers;
+// except that a ZIP channel, being inflated as it is read, must be read
+// by one thread at a time.
 
 void readunpackrow(psd_file_t psd,        // input file handle
 				   struct channel_info *chan, // channel info
@@ -31,58 +70,487 @@ void readunpackrow(psd_file_t psd,        // input file handle
 				   unsigned char *inrow,  // dest buffer for the uncompressed row (rb bytes)
 				   unsigned char *rlebuf) // temporary buffer for compressed data, 2 x rb in size
 {
-	psd_pixels_t n = 0, rlebytes;
+	psd_pixels_t n = 0;
 	psd_bytes_t pos;
-	int seekres = 0;
+
+	prepchannel(psd, chan);
 
 	switch(chan->comptype){
 	case RAWDATA: /* uncompressed */
 		if(chan->rawpos){
 			pos = chan->rawpos + chan->rowbytes*row;
-			seekres = fseeko(psd, pos, SEEK_SET);
-			if(seekres != -1)
-				n = fread(inrow, 1, chan->rowbytes, psd);
+			n = psd_pread(psd, inrow, chan->rowbytes, pos);
 		}else{
 			warn_msg("# readunpackrow() called for raw data, but rawpos is zero");
 		}
 		break;
 	case RLECOMP:
 		if(chan->rowpos){
-			pos = chan->rowpos[row];
-			seekres = fseeko(psd, pos, SEEK_SET);
-			if(seekres != -1){
-				rlebytes = fread(rlebuf, 1, chan->rowpos[row+1] - pos, psd);
-				n = unpackbits(inrow, rlebuf, chan->rowbytes, rlebytes);
-			}
+			pos = rowstart(chan, row);
+			n = unpackbits(inrow, rlebuf, chan->rowbytes,
+						   readrle(psd, &rlebuf, rowstart(chan, row+1) - pos, pos));
 		}else{
 			warn_msg("# readunpackrow() called for RLE data, but rowpos is NULL");
 		}
 		break;
 	case ZIPNOPREDICT:
 	case ZIPPREDICT:
-		if(chan->unzipdata)
-			memcpy(inrow, chan->unzipdata + chan->rowbytes*row, chan->rowbytes);
-		else
-			warn_msg("# readunpackrow() called for ZIP data, but unzipdata is NULL");
-		return;
+		if(chan->zip)
+			n = psd_zip_readrows(psd, chan, row, 1, inrow);
+		else if(chan->length > 2)
+			warn_msg("# readunpackrow() called for ZIP data, but zip is NULL");
+		break;
 	}
 	// if we don't recognise the compression type, skip the row
 	// FIXME: or would it be better to use the last valid type seen?
 
-	if(seekres == -1)
-		alwayswarn("# can't seek to " LL_L("%lld\n","%ld\n"), pos);
+	padrow(chan, inrow, n);
+}
 
-	if(n < chan->rowbytes){
-		warn_msg("row data short (wanted %d, got %d bytes)", chan->rowbytes, n);
-		// zero out unwritten part of row
-		memset(inrow + n, 0xff, chan->rowbytes - n);
+// Read a block of consecutive rows, as readunpackrow() would, into outbuf
+// (nrows*rowbytes in size). For RLE, the packed data of the whole block
+// is fetched in one read, and rlebuf must be at least 2*rowbytes*nrows
+// in size; for other compression types, rowbytes is enough.
+// ZIP data is inflated directly into outbuf, in one call for the block.
+
+void readunpackrows(psd_file_t psd,
+					struct channel_info *chan,
+					psd_pixels_t row,     // index of first row
+					psd_pixels_t nrows,   // number of rows
+					unsigned char *outbuf,
+					unsigned char *rlebuf)
+{
+	psd_pixels_t j, n, avail;
+	psd_bytes_t pos, next, rowlen, got;
+
+	prepchannel(psd, chan);
+
+	if(chan->comptype == RLECOMP && chan->rowpos){
+		pos = rowstart(chan, row);
+		avail = readrle(psd, &rlebuf, rowstart(chan, row+nrows) - pos, pos);
+		for(j = 0; j < nrows; ++j, outbuf += chan->rowbytes, pos = next){
+			// the last rows may be short, if the block was
+			next = rowstart(chan, row+j+1);
+			rowlen = next - pos;
+			if(rowlen > avail)
+				rowlen = avail;
+			n = unpackbits(outbuf, rlebuf, chan->rowbytes, rowlen);
+			padrow(chan, outbuf, n);
+			rlebuf += rowlen;
+			avail -= rowlen;
+		}
+	}else if((chan->comptype == ZIPNOPREDICT || chan->comptype == ZIPPREDICT) && chan->zip){
+		got = psd_zip_readrows(psd, chan, row, nrows, outbuf);
+		for(j = 0; j < nrows; ++j, outbuf += chan->rowbytes, got -= n){
+			n = got < chan->rowbytes ? got : chan->rowbytes;
+			padrow(chan, outbuf, n);
+		}
+	}else{
+		for(j = 0; j < nrows; ++j, outbuf += chan->rowbytes)
+			readunpackrow(psd, chan, row+j, outbuf, rlebuf);
 	}
 }
 
+#ifdef HAVE_PTHREAD
+
+/* Reading an image ahead of its writer, in bands of rows decoded by
+ * worker threads (see --jobs). Bands go into a ring of buffers, and are
+ * handed to the writer in order by bands_row(); a band's buffer is
+ * reused once the writer has moved on. Bands of RLE or raw channels
+ * are decoded independently; ZIP data is inflated in order, so then
+ * a band waits for the previous one, but still ahead of the writer.
+ * Output of the decoding (warnings) is replayed as the band is handed
+ * over, so appears just as if the rows were read by the writer.
+ */
+
+#define BANDS_MEMORY (64L << 20) // limit on size of band buffers
+
+struct row_band{
+	struct psd_task task;
+	struct psd_capture out;
+	struct row_bands *b;
+	psd_pixels_t row, nrows;
+	unsigned char *buf, *rlebuf;
+};
+
+struct row_bands{
+	struct psd_cleanup cleanup; // closes it, if the file is abandoned
+	psd_file_t f;
+	struct psd_pool *pool;
+	struct channel_info **chan;
+	int channels;
+	psd_pixels_t rows, rowbytes, bandrows;
+	size_t bandsize;         // memory of each band (see mem_reserve())
+	int nbands, cur;         // ring size, index of band held by writer
+	psd_pixels_t nextrow;    // first row of next band to be decoded
+	struct row_band *band;
+	psd_pixels_t first, n;   // rows held by writer
+	unsigned char *buf;
+
+	int zip;                 // ZIP channels are read one band at a time
+	psd_pixels_t zipnext;    // first row of the band to be inflated next
+	pthread_mutex_t lock;
+	pthread_cond_t zipdone;
+};
+
+static void bandtask(void *arg){
+	struct row_band *band = arg;
+	struct row_bands *b = band->b;
+	psd_pixels_t j;
+	int ch;
+
+	capture_begin(&band->out);
+
+	if(b->zip){
+		pthread_mutex_lock(&b->lock);
+		while(b->zipnext != band->row)
+			pthread_cond_wait(&b->zipdone, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	// rows are read in the same order as by a single thread,
+	// so that any warnings are the same
+	for(j = 0; j < band->nrows; ++j)
+		for(ch = 0; ch < b->channels; ++ch){
+			if(b->chan[ch])
+				readunpackrow(b->f, b->chan[ch], band->row + j,
+							  band->buf + (ch*band->nrows + j)*b->rowbytes, band->rlebuf);
+			else
+				memset(band->buf + (ch*band->nrows + j)*b->rowbytes, 0, b->rowbytes);
+		}
+
+	if(b->zip){
+		pthread_mutex_lock(&b->lock);
+		b->zipnext += band->nrows;
+		pthread_cond_broadcast(&b->zipdone);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	capture_end(&band->out);
+}
+
+// Start decoding the next band into the given ring buffer, if any rows remain.
+
+static void startband(struct row_bands *b, struct row_band *band){
+	band->row = b->nextrow;
+	band->nrows = b->rows - b->nextrow < b->bandrows ? b->rows - b->nextrow : b->bandrows;
+	if(band->nrows){
+		b->nextrow += band->nrows;
+		capture_open(&band->out);
+		pool_submit(b->pool, &band->task, TASK_SHORT, bandtask, band);
+	}
+}
+
+static void abandonbands(void *arg){
+	bands_close(arg);
+}
+
+// Prepare to read 'rows' rows of the given channels (all of the same
+// size; a NULL channel reads as zeroes) through bands_next().
+// Returns NULL if there is not the memory for two bands (see --memlimit),
+// in which case the caller should read the rows itself.
+
+struct row_bands *bands_open(psd_file_t f, struct psd_pool *pool,
+							 struct channel_info **chan, int channels, psd_pixels_t rows)
+{
+	struct row_bands *b = checkmalloc(sizeof(struct row_bands));
+	size_t bytes;
+	int ch, i;
+
+	b->f = f;
+	b->pool = pool;
+	b->chan = checkmalloc(channels*sizeof(struct channel_info*));
+	b->channels = channels;
+	b->rows = rows;
+	b->rowbytes = 0;
+	b->zip = 0;
+	b->zipnext = 0;
+	for(ch = 0; ch < channels; ++ch)
+		if((b->chan[ch] = chan[ch])){
+			// the channels must be ready before threads read them
+			prepchannel(f, chan[ch]);
+			b->rowbytes = chan[ch]->rowbytes;
+			if(chan[ch]->comptype == ZIPNOPREDICT || chan[ch]->comptype == ZIPPREDICT)
+				b->zip = 1;
+		}
+
+	// Keep at least two bands in progress per thread, within the memory limit.
+	b->bandrows = ROWBLOCK;
+	bytes = (size_t)b->rowbytes*b->bandrows*channels;
+	b->nbands = 2*jobs;
+	if(b->nbands*bytes > BANDS_MEMORY)
+		b->nbands = BANDS_MEMORY / bytes;
+	if(b->nbands < 2)
+		b->nbands = 2;
+	b->bandsize = bytes + b->rowbytes*2;
+	b->band = checkmalloc(b->nbands*sizeof(struct row_band));
+	if((b->nbands = mem_reserve(b->bandsize, 0, b->nbands)) < 2){
+		mem_release(b->bandsize, b->nbands);
+		free(b->band);
+		free(b->chan);
+		free(b);
+		return NULL;
+	}
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->zipdone, NULL);
+
+	b->nextrow = b->first = b->n = 0;
+	b->cur = -1;
+	for(i = 0; i < b->nbands; ++i){
+		b->band[i].b = b;
+		b->band[i].nrows = 0;
+		b->band[i].buf = b->band[i].rlebuf = NULL;
+	}
+	cleanup_push(&b->cleanup, abandonbands, b);
+
+	for(i = 0; i < b->nbands; ++i){
+		b->band[i].buf = scratch_get((size_t)b->rowbytes*b->bandrows*channels);
+		b->band[i].rlebuf = scratch_get(b->rowbytes*2);
+		startband(b, &b->band[i]);
+	}
+	return b;
+}
+
+// Wait for the next band of rows, and return its buffer. This holds the
+// rows of each channel in turn: row r of channel ch, counting from the
+// band's first row, is at (ch*nrows + r)*rowbytes. Sets *nrows to the
+// number of rows in the band (zero when all have been read).
+
+static unsigned char *bands_next(struct row_bands *b, psd_pixels_t *nrows){
+	struct row_band *band;
+
+	// the writer is done with the previous band, so reuse its buffer
+	if(b->cur >= 0)
+		startband(b, &b->band[b->cur]);
+
+	b->cur = (b->cur + 1) % b->nbands;
+	band = &b->band[b->cur];
+	if(!band->nrows){
+		*nrows = 0; // no more
+		return NULL;
+	}
+
+	pool_wait(b->pool, &band->task);
+	capture_replay(&band->out);
+	*nrows = band->nrows;
+	return band->buf;
+}
+
+// Return a decoded row (rowbytes in size) of the given channel.
+// Rows must be requested in order, though any of the channels may be
+// read for each row. Returns NULL if there is no such row.
+
+unsigned char *bands_row(struct row_bands *b, int ch, psd_pixels_t row){
+	while(row >= b->first + b->n){
+		b->first += b->n;
+		if(!(b->buf = bands_next(b, &b->n)))
+			return NULL;
+	}
+	return b->buf + (ch*b->n + row - b->first)*b->rowbytes;
+}
+
+// Finish with a band reader. Bands already started are waited for.
+
+void bands_close(struct row_bands *b){
+	psd_pixels_t nrows;
+	int i;
+
+	cleanup_pop(&b->cleanup);
+	b->nextrow = b->rows; // start no more
+	while(bands_next(b, &nrows))
+		;
+	for(i = 0; i < b->nbands; ++i){
+		scratch_put(b->band[i].buf);
+		scratch_put(b->band[i].rlebuf);
+	}
+	mem_release(b->bandsize, b->nbands);
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->zipdone);
+	free(b->band);
+	free(b->chan);
+	free(b);
+}
+
+#endif
+
+// Locate the image data of a group of channels which share one
+// compression type field: a single layer channel, or all channels of the
+// merged image. For RLE, read the row counts and compute row positions;
+// for ZIP, set up the inflate state (nothing is decompressed yet).
+//   pos - file offset of group's data (after the compression type)
+// Uses positional reads only. Returns the offset following the data.
+
+static psd_bytes_t prepchannels(psd_file_t f,
+								struct layer_info *li,
+								struct channel_info *chan,
+								int channels,
+								struct psd_header *h,
+								psd_bytes_t pos)
+{
+	int ch;
+	psd_pixels_t count, last, j;
+	psd_bytes_t base = 0;
+	struct psd_cursor counts;
+	struct row_index *x;
+
+	// skip RLE counts, leave pos pointing to first row's compressed data.
+	// The counts for all channels are contiguous, so fetch them in one read.
+	cursor_init(&counts);
+	if(chan->comptype == RLECOMP){
+		cursor_pread(f, &counts, (channels*chan->rows) << h->version, pos);
+		pos += (channels*chan->rows) << h->version;
+	}
+
+	for(ch = 0; ch < channels; ++ch){
+		if(!chan->rows)
+			continue;
+
+		// For RLE, we read the row count array and compute file positions.
+		// For ZIP, rows are inflated as they are read.
+		switch(chan->comptype){
+		case RAWDATA:
+			chan[ch].rawpos = pos;
+			pos += chan->rowbytes*chan->rows;
+			break;
+
+		case RLECOMP:
+			/* accumulate RLE counts, to make an index of row start positions */
+			chan[ch].rowpos = x = docmalloc(h, sizeof(struct row_index));
+			x->base = docmalloc(h, (chan[ch].rows/ROWSTEP + 1)*sizeof(psd_bytes_t));
+			if((psd_bytes_t)ROWSTEP*2*chan[ch].rowbytes <= UINT16_MAX){
+				x->off16 = docmalloc(h, (chan[ch].rows+1)*sizeof(uint16_t));
+				x->off32 = NULL;
+			}else{
+				x->off16 = NULL;
+				x->off32 = docmalloc(h, (chan[ch].rows+1)*sizeof(uint32_t));
+			}
+			last = chan[ch].rowbytes;
+			for(j = 0; j <= chan[ch].rows; ++j){
+				if(j % ROWSTEP == 0)
+					x->base[j / ROWSTEP] = base = pos;
+				if(x->off16)
+					x->off16[j] = pos - base;
+				else
+					x->off32[j] = pos - base;
+				if(j == chan[ch].rows || counts.overrun)
+					break; // the last entry is the end of the last row
+
+				count = h->version==1 ? cur2Bu(&counts) : (psd_pixels_t)cur4B(&counts);
+
+				if(count < 2 || count > 2*chan[ch].rowbytes)  // this would be impossible
+					count = last; // make a guess, to help recover
+
+				last = count;
+				pos += count;
+			}
+			if(j < chan[ch].rows){
+				// the rows past the end of the counts read as empty
+				alwayswarn("# couldn't read RLE counts\n");
+				for(++j; j <= chan[ch].rows; ++j){
+					if(j % ROWSTEP == 0)
+						x->base[j / ROWSTEP] = base = pos;
+					if(x->off16)
+						x->off16[j] = pos - base;
+					else
+						x->off32[j] = pos - base;
+				}
+			}
+			break;
+
+		case ZIPNOPREDICT:
+		case ZIPPREDICT:
+			if(li){
+				// a channel of no more than its compression type has no data,
+				// and reads as empty rows
+				if(chan->length > 2){
+					chan->zip = psd_zip_open(h->depth, pos, chan->length - 2, 0, NULL);
+					pos += chan->length - 2;
+				}
+			}else{
+				// Merged channels are one stream, whose length isn't
+				// recorded, but nothing follows it in the file.
+				chan[ch].zip = psd_zip_open(h->depth, pos, 0,
+											(psd_bytes_t)ch*chan->rows*chan->rowbytes,
+											ch ? chan[ch-1].zip : NULL);
+			}
+			break;
+
+		default:
+			if(li)
+				alwayswarn("## bad compression type: %d; skipping channel (id %2d) in layer \"%s\"\n",
+						   chan->comptype, chan->id, li->name);
+			else
+				alwayswarn("## bad compression type: %d; skipping channel\n", chan->comptype);
+			break;
+		}
+	}
+
+	cursor_free(&counts);
+
+	if(li && pos != chan->filepos + chan->length)
+		alwayswarn("# channel data is %lu bytes, but length = %lu\n",
+				   (unsigned long)(pos - chan->filepos), (unsigned long)chan->length);
+
+	return pos;
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t prep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prep_done = PTHREAD_COND_INITIALIZER;
+#endif
+
+// Complete the preparation of a channel which was deferred by dochannel().
+// This is done by readunpackrow() as each row is read, so once prepared
+// it costs a single load. Of the threads reading channels of one group,
+// the first to claim it prepares it, and the others wait until it's done.
+
+void prepchannel(psd_file_t f, struct channel_info *chan){
+	struct channel_group *g;
+	jmp_buf *save;
+	int ch;
+
+#ifdef HAVE_PTHREAD
+	if( !(g = __atomic_load_n(&chan->deferred, __ATOMIC_ACQUIRE)) )
+		return;
+	if(__atomic_exchange_n(&g->claimed, 1, __ATOMIC_ACQ_REL)){
+		pthread_mutex_lock(&prep_lock);
+		while(__atomic_load_n(&chan->deferred, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&prep_done, &prep_lock);
+		pthread_mutex_unlock(&prep_lock);
+		return;
+	}
+#else
+	if( !(g = chan->deferred) )
+		return;
+#endif
+
+	save = fatal_jmp;
+	fatal_jmp = NULL; // others may be waiting for this (see recover_begin())
+	prepchannels(f, g->li, g->chan, g->channels, g->h, g->chan->filepos + 2);
+	fatal_jmp = save;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&prep_lock);
+	for(ch = 0; ch < g->channels; ++ch)
+		__atomic_store_n(&g->chan[ch].deferred, NULL, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&prep_done);
+	pthread_mutex_unlock(&prep_lock);
+#else
+	for(ch = 0; ch < g->channels; ++ch)
+		g->chan[ch].deferred = NULL;
+#endif
+}
+
 // Read channel metadata and populate the chan[] struct
 // in preparation for later reading/decompression of image data.
 // Called individually for layer channels (channels always == 1), and
 // once for entire merged data (channels == PSD header channel count).
+// The file is left positioned after the channel data.
+//
+// If PNG output is off, pixel data may never be needed (e.g. --xmlout
+// or --list only), so reading RLE counts and decompressing ZIP data
+// is deferred until the first row is requested (see prepchannel()).
 
 const char *comptype[] = {"raw", "RLE", "ZIP without prediction", "ZIP with prediction"};
 
@@ -94,11 +562,10 @@ void dochannel(psd_file_t f,
 {
 	int compr, ch;
 	psd_bytes_t chpos, pos;
-	unsigned char *zipdata;
-	psd_pixels_t count, last, j, rb;
+	psd_pixels_t rb;
+	struct channel_group *g;
 
 	chpos = ftello(f);
-
 	if(li){
 		VERBOSE(">>> channel id = %2d @ " LL_L("%7lld, %lld","%7ld, %ld") " bytes\n",
 				chan->id, chpos, chan->length);
@@ -141,14 +608,6 @@ void dochannel(psd_file_t f,
 	VERBOSE("    uncompressed size %u bytes (row bytes = %u)\n",
 			channels*chan->rows*rb, rb);
 
-	// Prepare compressed data for later access:
-
-	pos = chpos + 2;
-
-	// skip RLE counts, leave pos pointing to first row's compressed data
-	if(compr == RLECOMP)
-		pos += (channels*chan->rows) << h->version;
-
 	for(ch = 0; ch < channels; ++ch){
 		if(!li){
 			// if required, identify first alpha channel as merged data transparency
@@ -159,82 +618,30 @@ void dochannel(psd_file_t f,
 		chan[ch].comptype = compr;
 		chan[ch].rows = chan->rows;
 		chan[ch].cols = chan->cols;
+		chan[ch].filepos = chpos;
 		chan[ch].rowpos = NULL;
-		chan[ch].unzipdata = NULL;
+		chan[ch].zip = NULL;
 		chan[ch].rawpos = 0;
-
-		if(!chan->rows)
-			continue;
-
-		// For RLE, we read the row count array and compute file positions.
-		// For ZIP, read and decompress whole channel.
-		switch(compr){
-		case RAWDATA:
-			chan[ch].rawpos = pos;
-			pos += chan->rowbytes*chan->rows;
-			break;
-
-		case RLECOMP:
-			/* accumulate RLE counts, to make array of row start positions */
-			chan[ch].rowpos = checkmalloc((chan[ch].rows+1)*sizeof(psd_bytes_t));
-			last = chan[ch].rowbytes;
-			for(j = 0; j < chan[ch].rows && !feof(f); ++j){
-				count = h->version==1 ? get2Bu(f) : (psd_pixels_t)get4B(f);
-
-				if(count < 2 || count > 2*chan[ch].rowbytes)  // this would be impossible
-					count = last; // make a guess, to help recover
-
-				last = count;
-				chan[ch].rowpos[j] = pos;
-				pos += count;
-			}
-			if(j < chan[ch].rows){
-				fatal("# couldn't read RLE counts");
-			}
-			chan[ch].rowpos[j] = pos; /* = end of last row */
-			break;
-
-		case ZIPNOPREDICT:
-		case ZIPPREDICT:
-			if(li){
-				pos += chan->length - 2;
-
-				zipdata = checkmalloc(chan->length);
-				count = fread(zipdata, 1, chan->length - 2, f);
-				if(count < chan->length - 2)
-					alwayswarn("ZIP data short: wanted %ld bytes, got %ld", chan->length, count);
-
-				chan->unzipdata = checkmalloc(chan->rows*chan->rowbytes);
-				if(compr == ZIPNOPREDICT)
-					psd_unzip_without_prediction(zipdata, count, chan->unzipdata,
-												 chan->rows*chan->rowbytes);
-				else
-					psd_unzip_with_prediction(zipdata, count, chan->unzipdata,
-											  chan->rows*chan->rowbytes,
-											  chan->cols, h->depth);
-
-				free(zipdata);
-			}else{
-				alwayswarn("## can't process ZIP outside layer\n");
-			}
-			break;
-
-		default:
-			if(li)
-				alwayswarn("## bad compression type: %d; skipping channel (id %2d) in layer \"%s\"\n",
-						   compr, chan->id, li->name);
-			else
-				alwayswarn("## bad compression type: %d; skipping channel\n", compr);
-
-			if(li)
-				fseeko(f, chan->length - 2, SEEK_CUR);
-			break;
-		}
+		chan[ch].deferred = NULL;
 	}
 
-	if(li && pos != chpos + chan->length)
-		alwayswarn("# channel data is %lu bytes, but length = %lu\n",
-				   (unsigned long)(pos - chpos), (unsigned long)chan->length);
+	if(writepng || (compr != RLECOMP && compr != ZIPNOPREDICT && compr != ZIPPREDICT)){
+		// Prepare compressed data for later access now
+		pos = prepchannels(f, li, chan, channels, h, chpos + 2);
+	}else{
+		g = docmalloc(h, sizeof(struct channel_group));
+		g->li = li;
+		g->h = h;
+		g->chan = chan;
+		g->channels = channels;
+		g->claimed = 0;
+		for(ch = 0; ch < channels; ++ch)
+			chan[ch].deferred = g;
+
+		// Without the RLE counts, the end of merged data is not known;
+		// but nothing follows it.
+		pos = li ? chpos + chan->length : chpos + 2;
+	}
 
 	fseeko(f, pos, SEEK_SET);
 }
@@ -55,7 +55,7 @@ char *conv_unicodestr(psd_file_t f, long count){
 
 		iconv(ic, NULL, &inb, NULL, &outb); // reset iconv state
 
-		outb = 6*count; // sloppy overestimate of buffer (FIXME)
+		outb = 6*count + 1; // sloppy overestimate of buffer, with room for NUL (FIXME)
 		if( (utf8 = checkmalloc(outb)) ){
 			inbuf = buf;
 			inb = 2*n;
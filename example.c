@@ -34,17 +34,20 @@
 int verbose = 0, quiet = 1, rsrc = 0, print_rsrc = 0, resdump = 0, extra = 0,
 	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
 	writepng = 0, writelist = 0, writexml = 0, unicode_filenames = 1,
-	rebuild = 0;
+	rebuild = 0, jobs = 1, parallel_layers = 1;
 long hres, vres; // we don't use these, but they're set within doresources()
 char *pngdir;
 
 int main(int argc, char *argv[]){
-	FILE *f;
+	psd_file_t f;
 	struct psd_header h;
 
-	if(argc == 2 && (f = fopen(argv[1], "rb"))){
+	if(argc == 2 && (f = psd_open(argv[1]))){
 		h.version = h.nlayers = 0;
 		h.layerdatapos = 0;
+		h.linfo = NULL;
+		h.merged_chans = NULL;
+		h.arena = NULL;
 
 		if(dopsd(f, argv[1], &h)){
 			/* The following members of psd_header struct h are initialised:
@@ -64,12 +67,14 @@ int main(int argc, char *argv[]){
 			// process merged (composite) image data
 			doimage(f, NULL, NULL, &h);
 
+			// release the layer and channel information
+			docfree(&h);
 			return EXIT_SUCCESS;
 		}else{
 			fprintf(stderr, "Not a PSD or PSB file.\n");
 		}
 
-		fclose(f);
+		psd_close(f);
 	}else{
 		fprintf(stderr, "Could not open: %s\n", argv[1]);
 	}
@@ -129,7 +134,9 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 			// how to find image data, depending on compression type:
 			//   rawpos                - file offset of RAW channel data (AFTER compression type)
 			//   rowpos                - row data file positions (RLE ONLY)
-			//   unzipdata             - uncompressed data (ZIP ONLY)
+			//   zip                   - inflate state (ZIP ONLY)
+			// unless PNG output is on, these are only filled in when
+			// readunpackrow() first reads a row (see prepchannel())
 
 			dochannel(f, li, li->chan + ch, 1, h);
 			printf("  channel %d  id=%2d  %4u rows x %4u cols  %6ld bytes\n",
@@ -20,7 +20,7 @@
 #include "psdparse.h"
 
 #ifdef HAVE_ICONV_H
-	extern iconv_t ic;
+	extern THREAD_LOCAL iconv_t ic;
 #endif
 
 /* 'Extra data' handling. *Work in progress*
@@ -29,7 +29,7 @@
  * due to many errors and omissions in Adobe's documentation.
  */
 
-static struct psd_header *psd_header = NULL;
+static THREAD_LOCAL struct psd_header *psd_header = NULL;
 
 #define BITSTR(f) ((f) ? "(1)" : "(0)")
 
@@ -280,8 +280,7 @@ void conv_unicodestyles(psd_file_t f, long count, const char *indent){
 					}
 
 					// copy to terminal
-					if(verbose)
-						fwrite(utf8, 1, outbuf-utf8, stdout);
+					VERBOSE("%.*s", (int)(outbuf-utf8), utf8);
 				}else
 					alwayswarn("iconv() failed, errno=%u\n", errno);
 			}
@@ -393,11 +392,14 @@ static void ed_typetool(psd_file_t f, int level, int len, struct dictentry *pare
 }
 
 // Stores last layer name encountered; pointer to UTF-8 string.
-char *last_layer_name = NULL;
+THREAD_LOCAL char *last_layer_name = NULL;
 
 static void ed_unicodename(psd_file_t f, int level, int len, struct dictentry *parent){
 	unsigned long length = get4B(f); // character count, not byte count
-	char *buf = last_layer_name = conv_unicodestr(f, length);
+	char *buf;
+
+	free(last_layer_name); // if there was another
+	buf = last_layer_name = conv_unicodestr(f, length);
 
 	if(buf){
 		if(xml)
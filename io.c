@@ -0,0 +1,653 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Input backends for the parser.
+ *
+ * The parser reads its input with fgetc/fread/fseeko/ftello/feof, which
+ * psdparse.h redirects to the psd_* functions below (in the same way
+ * that the plugin build redirects them to the pl_* shims in plugin.c).
+ * These dispatch through the psd_io vtable of the open psd_file_t:
+ *
+ *   stdio  - plain FILE* stream; used for pipes, devices, or when the
+ *            file can't be mapped (e.g. too large for a 32-bit process)
+ *   mmap   - the whole file mapped read-only into memory
+ *   memory - a caller-supplied buffer (e.g. for use as a library)
+ *
+ * The mmap and memory backends share all read operations; they only
+ * differ in how they are released.
+ *
+ * psd_pread() reads at a given offset without using or changing the
+ * file position, so that several threads may read one open file.
+ * This is always true of the in-memory backends, and of the stdio
+ * backend where pread(2) is available (HAVE_PREAD).
+ *
+ * Output files are plain stdio streams, though with --jobs they may
+ * be written by a background thread (see fopen_out()).
+ */
+
+#define PSD_IO_IMPL
+
+#ifdef HAVE_FOPENCOOKIE
+	#define _GNU_SOURCE // for fopencookie()
+#endif
+
+#include "psdparse.h"
+
+#ifndef PSDPARSE_PLUGIN
+
+#ifdef HAVE_PREAD
+	#include <unistd.h>
+#endif
+
+// stdio backend ------------------------------------------------------
+
+static int stdio_getbyte(psd_file_t f){
+	return fgetc(f->fp);
+}
+
+static size_t stdio_read(void *ptr, size_t n, psd_file_t f){
+	return fread(ptr, 1, n, f->fp);
+}
+
+static int stdio_seek(psd_file_t f, off_t pos, int wh){
+	return fseeko(f->fp, pos, wh);
+}
+
+static off_t stdio_tell(psd_file_t f){
+	return ftello(f->fp);
+}
+
+static int stdio_eof(psd_file_t f){
+	return feof(f->fp);
+}
+
+static void stdio_close(psd_file_t f){
+	fclose(f->fp);
+}
+
+static size_t stdio_pread(psd_file_t f, void *ptr, size_t n, off_t pos){
+#ifdef HAVE_PREAD
+	// bypasses the stream's buffer, which is fine as input is never written
+	size_t done = 0;
+	ssize_t cnt;
+
+	while(done < n){
+		cnt = pread(fileno(f->fp), (char*)ptr + done, n - done, pos + done);
+		if(cnt > 0)
+			done += cnt;
+		else if(cnt == 0 || errno != EINTR)
+			break;
+	}
+	return done;
+#else
+	// not thread safe
+	size_t cnt = 0;
+	off_t savepos = ftello(f->fp);
+
+	if(fseeko(f->fp, pos, SEEK_SET) == 0)
+		cnt = fread(ptr, 1, n, f->fp);
+	fseeko(f->fp, savepos, SEEK_SET);
+	return cnt;
+#endif
+}
+
+static const struct psd_io stdio_io = {
+	stdio_getbyte, stdio_read, stdio_seek, stdio_tell, stdio_eof, stdio_close,
+	stdio_pread
+};
+
+#ifdef HAVE_PREAD
+// A second handle on a stdio file (see psd_dup()) reads at its own
+// position with pread(2), leaving the stream alone.
+
+static int dup_getbyte(psd_file_t f){
+	unsigned char c;
+
+	if(stdio_pread(f, &c, 1, f->pos) == 1){
+		++f->pos;
+		return c;
+	}
+	f->eof = 1;
+	return EOF;
+}
+
+static size_t dup_read(void *ptr, size_t n, psd_file_t f){
+	size_t cnt = stdio_pread(f, ptr, n, f->pos);
+
+	if(cnt < n)
+		f->eof = 1;
+	f->pos += cnt;
+	return cnt;
+}
+
+static int mem_seek(psd_file_t f, off_t pos, int wh);
+static off_t mem_tell(psd_file_t f);
+static int mem_eof(psd_file_t f);
+static void mem_close(psd_file_t f);
+
+static const struct psd_io dup_io = {
+	dup_getbyte, dup_read, mem_seek, mem_tell, mem_eof, mem_close,
+	stdio_pread
+};
+#endif
+
+// memory backend (also used for mapped files) ------------------------
+
+static int mem_getbyte(psd_file_t f){
+	if(f->pos < f->size)
+		return f->base[f->pos++];
+	f->eof = 1;
+	return EOF;
+}
+
+static size_t mem_read(void *ptr, size_t n, psd_file_t f){
+	psd_bytes_t avail = f->pos < f->size ? f->size - f->pos : 0;
+
+	if(n > avail){
+		n = avail;
+		f->eof = 1; // like stdio, only set by reading past the end
+	}
+	if(n){
+		if(ptr) // NULL when called from psd_readptr()
+			memcpy(ptr, f->base + f->pos, n);
+		f->pos += n;
+	}
+	return n;
+}
+
+static int mem_seek(psd_file_t f, off_t pos, int wh){
+	switch(wh){
+	case SEEK_SET: break;
+	case SEEK_CUR: pos += f->pos; break;
+	case SEEK_END: pos += f->size; break;
+	default: return -1;
+	}
+	if(pos < 0)
+		return -1;
+
+	// as with stdio, it is not an error to seek beyond the end
+	f->pos = pos;
+	f->eof = 0;
+	return 0;
+}
+
+static off_t mem_tell(psd_file_t f){
+	return f->pos;
+}
+
+static int mem_eof(psd_file_t f){
+	return f->eof;
+}
+
+static void mem_close(psd_file_t f){
+	// buffer belongs to caller
+}
+
+static size_t mem_pread(psd_file_t f, void *ptr, size_t n, off_t pos){
+	size_t got;
+	unsigned char *p = psd_preadptr(f, n, pos, &got);
+
+	if(got)
+		memcpy(ptr, p, got);
+	return got;
+}
+
+static const struct psd_io mem_io = {
+	mem_getbyte, mem_read, mem_seek, mem_tell, mem_eof, mem_close,
+	mem_pread
+};
+
+#ifdef CAN_MMAP
+static void mmap_close(psd_file_t f){
+	unmap_file(f->base, f->size);
+	fclose(f->fp);
+}
+
+static const struct psd_io mmap_io = {
+	mem_getbyte, mem_read, mem_seek, mem_tell, mem_eof, mmap_close,
+	mem_pread
+};
+#endif
+
+// Open a PSD for reading. A regular file is memory mapped if possible,
+// otherwise it is read through stdio.
+// Returns NULL if the file can't be opened.
+
+psd_file_t psd_open(char *path){
+	psd_file_t f;
+	FILE *fp;
+#ifdef CAN_MMAP
+	struct stat sb;
+	void *addr;
+#endif
+
+	if(!(fp = fopen(path, "rb")))
+		return NULL;
+
+	f = checkmalloc(sizeof(struct psd_file));
+	f->fp = fp;
+	f->base = NULL;
+	f->size = f->pos = 0;
+	f->eof = 0;
+
+#ifdef CAN_MMAP
+	if(fstat(fileno(fp), &sb) == 0
+	   && (sb.st_mode & S_IFMT) == S_IFREG
+	   && sb.st_size > 0
+	   && (psd_bytes_t)(size_t)sb.st_size == (psd_bytes_t)sb.st_size // fits in address space?
+	   && (addr = map_file(fileno(fp), sb.st_size)))
+	{
+		f->io = &mmap_io;
+		f->base = addr;
+		f->size = sb.st_size;
+		return f;
+	}
+#endif
+
+	f->io = &stdio_io;
+	return f;
+}
+
+// Open an in-memory PSD image. The buffer must remain valid,
+// and unmodified, until psd_close().
+
+psd_file_t psd_open_mem(void *buf, size_t len){
+	psd_file_t f = checkmalloc(sizeof(struct psd_file));
+
+	f->io = &mem_io;
+	f->fp = NULL;
+	f->base = buf;
+	f->size = len;
+	f->pos = 0;
+	f->eof = 0;
+	return f;
+}
+
+// Open another handle on the same input, with its own file position,
+// for use by another thread. It must be closed (by psd_close()) before
+// the original. Returns NULL where this isn't possible (a stdio stream,
+// without pread(2)).
+
+psd_file_t psd_dup(psd_file_t f){
+	psd_file_t g;
+#ifdef HAVE_PREAD
+	struct stat sb;
+#endif
+
+	if(f->base){
+		g = psd_open_mem(f->base, f->size);
+		g->pos = f->pos;
+		return g;
+	}
+#ifdef HAVE_PREAD
+	g = checkmalloc(sizeof(struct psd_file));
+	g->io = &dup_io;
+	g->fp = f->fp;
+	g->base = NULL;
+	g->size = fstat(fileno(f->fp), &sb) == 0 ? sb.st_size : 0; // for SEEK_END
+	g->pos = f->io->tell(f);
+	g->eof = 0;
+	return g;
+#else
+	return NULL;
+#endif
+}
+
+void psd_close(psd_file_t f){
+	f->io->close(f);
+	free(f);
+}
+
+// If the whole file is addressable in memory (mmap or memory backend),
+// return its base address and set *len to its size. Otherwise NULL.
+
+unsigned char *psd_mapping(psd_file_t f, size_t *len){
+	if(f->base)
+		*len = f->size;
+	return f->base;
+}
+
+// If the file is in memory, consume the next n bytes and return
+// a pointer to them, setting *got to the number actually available
+// (fewer than n at end of file, like fread). Otherwise NULL, with *got zero.
+
+unsigned char *psd_readptr(psd_file_t f, size_t n, size_t *got){
+	unsigned char *p;
+
+	*got = 0;
+	if(!f->base)
+		return NULL;
+	p = f->base + (f->pos < f->size ? f->pos : f->size);
+	*got = mem_read(NULL, n, f);
+	return p;
+}
+
+// Positional analogue of psd_readptr(): return a pointer to the n bytes
+// at offset pos, setting *got to the number actually available.
+// The file position is not used or changed. NULL (and *got zero)
+// if not in memory.
+
+unsigned char *psd_preadptr(psd_file_t f, size_t n, off_t pos, size_t *got){
+	psd_bytes_t avail;
+
+	*got = 0;
+	if(!f->base)
+		return NULL;
+	if(pos < 0 || (psd_bytes_t)pos > f->size)
+		pos = f->size;
+	avail = f->size - pos;
+	*got = n < avail ? n : avail;
+	return f->base + pos;
+}
+
+// Read n bytes at offset pos, without using or changing the file
+// position. Returns the number of bytes read.
+
+size_t psd_pread(psd_file_t f, void *ptr, size_t n, off_t pos){
+	return f->io->pread(f, ptr, n, pos);
+}
+
+// the redirected stdio calls ------------------------------------------
+
+int psd_fgetc(psd_file_t f){
+	return f->io->getbyte(f);
+}
+
+int psd_feof(psd_file_t f){
+	return f->io->eof(f);
+}
+
+size_t psd_fread(void *ptr, size_t s, size_t n, psd_file_t f){
+	return s ? f->io->read(ptr, s*n, f) / s : 0;
+}
+
+int psd_fseeko(psd_file_t f, off_t pos, int wh){
+	return f->io->seek(f, pos, wh);
+}
+
+off_t psd_ftello(psd_file_t f){
+	return f->io->tell(f);
+}
+
+// Can several threads read the file at once, with psd_pread()?
+
+int psd_concurrent(psd_file_t f){
+#ifdef HAVE_PREAD
+	return 1;
+#else
+	return f->io != &stdio_io;
+#endif
+}
+
+// output files -------------------------------------------------------
+
+/* With --jobs, output files are written behind: a stream's data is
+ * queued for a writer thread, so that writing (perhaps to slow or network
+ * storage) overlaps the decoding and compression of what follows.
+ * The queue is bounded; a thread which fills it waits for the writer.
+ * Seeks only move the stream's own position, as each queued block
+ * records where it goes. Closing a stream waits for its blocks, so that
+ * any write error is still reported then.
+ * Two threads may want the same name (layers of the same name, or files
+ * of a --batch sharing a directory): the second waits for the first to
+ * close the file before opening it, so the two are never mixed; the
+ * file is left as whichever wrote it last, as without --jobs.
+ * The stream is made by fopencookie() (glibc, HAVE_FOPENCOOKIE)
+ * or funopen() (BSD and Mac OS X, HAVE_FUNOPEN).
+ */
+
+#if defined(HAVE_PTHREAD) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+
+#define WRITE_QUEUE  (16L<<20)  // limit on bytes queued for the writer
+#define WRITE_BUFFER (256L<<10) // stream buffer, so that blocks are large
+
+struct out_file{
+	FILE *fp;        // the file itself, used by the writer thread
+	off_t pos, size; // as seen through the stream
+	off_t fppos;     // position of fp
+	int pending;     // blocks queued
+	int error;
+	struct out_file *next; // in out_open
+	char *name;
+};
+
+struct out_block{
+	struct out_file *of;
+	off_t pos;
+	size_t len;
+	struct out_block *next;
+	// followed by the data
+};
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_work = PTHREAD_COND_INITIALIZER, // block queued
+					  out_done = PTHREAD_COND_INITIALIZER; // block written
+static struct out_block *out_head, *out_tail;
+static size_t out_queued;
+static struct out_file *out_open; // files open for writing
+
+// Wait until no other stream has the named file open, then claim it.
+// Called with out_lock held.
+
+static void out_claim(struct out_file *of){
+	struct out_file *o;
+
+	for(o = out_open; o; )
+		if(strcmp(o->name, of->name))
+			o = o->next;
+		else{
+			pthread_cond_wait(&out_done, &out_lock);
+			o = out_open;
+		}
+	of->next = out_open;
+	out_open = of;
+}
+
+static void out_unclaim(struct out_file *of){
+	struct out_file **o;
+
+	pthread_mutex_lock(&out_lock);
+	for(o = &out_open; *o != of; o = &(*o)->next)
+		;
+	*o = of->next;
+	pthread_cond_broadcast(&out_done);
+	pthread_mutex_unlock(&out_lock);
+}
+
+static void *writer(void *arg){
+	struct out_block *b;
+	struct out_file *of;
+	int err;
+
+	pthread_mutex_lock(&out_lock);
+	for(;;){
+		while(!(b = out_head))
+			pthread_cond_wait(&out_work, &out_lock);
+		of = b->of;
+		err = of->error;
+		pthread_mutex_unlock(&out_lock);
+
+		// the block stays queued until written, so that close waits for it
+		if(!err){
+			err = (of->fppos != b->pos && fseeko(of->fp, b->pos, SEEK_SET))
+				  || fwrite(b + 1, 1, b->len, of->fp) != b->len;
+			of->fppos = b->pos + b->len;
+		}
+
+		pthread_mutex_lock(&out_lock);
+		if(!(out_head = b->next))
+			out_tail = NULL;
+		out_queued -= b->len;
+		of->error |= err;
+		--of->pending;
+		pthread_cond_broadcast(&out_done);
+		free(b);
+	}
+	return NULL;
+}
+
+static int out_write(struct out_file *of, const char *buf, size_t n){
+	struct out_block *b;
+
+	if(!n)
+		return 0;
+
+	b = checkmalloc(sizeof(struct out_block) + n);
+	b->of = of;
+	b->pos = of->pos;
+	b->len = n;
+	b->next = NULL;
+	memcpy(b + 1, buf, n);
+
+	pthread_mutex_lock(&out_lock);
+	while(out_queued && out_queued + n > WRITE_QUEUE && !of->error)
+		pthread_cond_wait(&out_done, &out_lock);
+	if(of->error){
+		pthread_mutex_unlock(&out_lock);
+		free(b);
+		return -1;
+	}
+	if(out_tail)
+		out_tail->next = b;
+	else
+		out_head = b;
+	out_tail = b;
+	out_queued += n;
+	++of->pending;
+	pthread_cond_signal(&out_work);
+	pthread_mutex_unlock(&out_lock);
+
+	of->pos += n;
+	if(of->pos > of->size)
+		of->size = of->pos;
+	return n;
+}
+
+static int out_seek(struct out_file *of, off_t *pos, int wh){
+	off_t p = *pos + (wh == SEEK_CUR ? of->pos : (wh == SEEK_END ? of->size : 0));
+
+	if(p < 0)
+		return -1;
+	*pos = of->pos = p;
+	return 0;
+}
+
+static int out_close(void *cookie){
+	struct out_file *of = cookie;
+	int err;
+
+	pthread_mutex_lock(&out_lock);
+	while(of->pending)
+		pthread_cond_wait(&out_done, &out_lock);
+	err = of->error;
+	pthread_mutex_unlock(&out_lock);
+
+	err |= fclose(of->fp) != 0;
+	out_unclaim(of);
+	free(of);
+	return err ? EOF : 0;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+	static ssize_t cookie_write(void *cookie, const char *buf, size_t n){
+		return out_write(cookie, buf, n);
+	}
+
+	static int cookie_seek(void *cookie, off64_t *pos, int wh){
+		off_t p = *pos;
+		int res = out_seek(cookie, &p, wh);
+
+		*pos = p;
+		return res;
+	}
+#else
+	static int funopen_write(void *cookie, const char *buf, int n){
+		return out_write(cookie, buf, n);
+	}
+
+	static fpos_t funopen_seek(void *cookie, fpos_t pos, int wh){
+		off_t p = pos;
+
+		return out_seek(cookie, &p, wh) ? -1 : p;
+	}
+#endif
+
+#endif
+
+// Open an output file for writing (binary), written behind with --jobs.
+
+FILE *fopen_out(char *name){
+#if defined(HAVE_PTHREAD) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+	static int started;
+	struct out_file *of;
+	pthread_t tid;
+	FILE *fp, *f = NULL;
+
+	if(jobs <= 1)
+		return fopen(name, "wb");
+
+	of = checkmalloc(sizeof(struct out_file) + strlen(name) + 1);
+	of->name = strcpy((char*)(of + 1), name);
+	of->pos = of->size = of->fppos = 0;
+	of->pending = of->error = 0;
+
+	pthread_mutex_lock(&out_lock);
+	if(!started && pthread_create(&tid, NULL, writer, NULL) == 0){
+		pthread_detach(tid);
+		started = 1;
+	}
+	out_claim(of); // before opening, which would truncate the file
+	pthread_mutex_unlock(&out_lock);
+
+	if( (of->fp = fp = fopen(name, "wb")) && started ){
+#ifdef HAVE_FOPENCOOKIE
+		cookie_io_functions_t io = {NULL, cookie_write, cookie_seek, out_close};
+		f = fopencookie(of, "wb", io);
+#else
+		f = funopen(of, NULL, funopen_write, funopen_seek, out_close);
+#endif
+	}
+	if(!f){
+		// not written behind, and so not kept from the same name
+		out_unclaim(of);
+		free(of);
+		return fp;
+	}
+	setvbuf(f, NULL, _IOFBF, WRITE_BUFFER);
+	return f;
+#else
+	return fopen(name, "wb");
+#endif
+}
+
+int fseeko_out(FILE *f, off_t pos, int wh){
+	return fseeko(f, pos, wh);
+}
+
+off_t ftello_out(FILE *f){
+	return ftello(f);
+}
+
+// Read back a temporary file written by the program (e.g. see spillpacked()).
+
+size_t fread_out(void *ptr, size_t s, size_t n, FILE *f){
+	return fread(ptr, s, n, f);
+}
+
+#endif
@@ -17,6 +17,8 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <time.h>
+
 #ifdef HAVE_SETRLIMIT
 	#include <sys/resource.h>
 #endif
@@ -29,15 +31,14 @@
 	#include "zlib.h"
 #endif
 
-extern int nwarns;
-extern char indir[];
-
-char *pngdir = indir;
+char *pngdir = NULL; // NULL: a directory named for each input file
 int verbose = DEFAULT_VERBOSE, quiet = 0, rsrc = 0, print_rsrc = 0, resdump = 0, extra = 0,
 	scavenge = 0, scavenge_psb = 0, scavenge_depth = 8, scavenge_mode = -1,
 	scavenge_rows = 0, scavenge_cols = 0, scavenge_chan = 3, scavenge_rle = 0,
 	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
-	unicode_filenames = 0, rebuild = 0, rebuild_v1 = 0, merged_only = 0;
+	unicode_filenames = 0, rebuild = 0, rebuild_v1 = 0, merged_only = 0, jobs = 1,
+	parallel_layers = 1;
+static int batch = 0;
 uint32_t hres, vres; // we don't use these, but they're set within doresources()
 
 #ifdef ALWAYS_WRITE_PNG
@@ -48,6 +49,355 @@ uint32_t hres, vres; // we don't use these, but they're set within doresources()
 	int writepng = 0, writelist = 0, writexml = 0;
 #endif
 
+enum{FILE_OK, FILE_UNREADABLE, FILE_INVALID};
+
+// Process an open input file. Returns FILE_OK, or FILE_INVALID.
+
+static int processdoc(psd_file_t f, char *path, struct psd_header *h){
+	int j, status = FILE_INVALID;
+	psd_bytes_t k;
+	char *base;
+	unsigned char *addr = NULL;
+	size_t maplen = 0;
+	char temp_str[PATH_MAX];
+
+	resetwarns();
+
+	if(!quiet && !xmlout)
+		printf("Processing \"%s\"\n", path);
+
+	base = strrchr(path, DIRSEP);
+
+	h->version = h->nlayers = 0;
+	h->layerdatapos = 0;
+	h->linfo = NULL;
+	h->merged_chans = NULL;
+	h->arena = NULL;
+
+#ifdef CAN_MMAP
+	// scavenging routines need the file memory mapped
+	addr = NULL;
+	if((scavenge || scavenge_psb || scavenge_rle)
+	   && !(addr = psd_mapping(f, &maplen)))
+		fprintf(stderr, "mmap() failed, or not a regular file\n");
+
+	if((scavenge || scavenge_psb) && addr)
+	{
+		h->version = 1 + scavenge_psb;
+		h->channels = scavenge_chan;
+		h->rows = scavenge_rows;
+		h->cols = scavenge_cols;
+		h->depth = scavenge_depth;
+		h->mode = scavenge_mode;
+		scavenge_psd(addr, maplen, h);
+		status = FILE_OK;
+
+		openfiles(path, h);
+
+		if(xml){
+			fputs("<PSD FILE='", xml);
+			fputsxml(path, xml);
+			fputs("'>\n", xml);
+		}
+
+		for(j = 0; j < h->nlayers; ++j){
+			fseeko(f, h->linfo[j].filepos, SEEK_SET);
+			if(!readlayerinfo(f, h, j)){
+				h->nlayers = j;
+				break;
+			}
+		}
+
+		h->layerdatapos = ftello(f);
+		layeroffsets(h, h->layerdatapos);
+
+		// Layer content starts immediately after the last layer's 'metadata'.
+		// If we did not correctly locate the *last* layer, we are not going to
+		// succeed in extracting data for any layer.
+		processlayers(f, h);
+
+		// if no layers found, try to locate merged data
+		if(!h->nlayers && h->rows && h->cols && h->lmistart){
+			// position file after 'layer & mask info'
+			fseeko(f, h->lmistart + h->lmilen, SEEK_SET);
+			// process merged (composite) image data
+			doimage(f, NULL, base ? base+1 : path, h);
+		}
+	}
+	else
+#endif
+
+	if(dopsd(f, path, h)){
+		psd_bytes_t n;
+
+		status = FILE_OK;
+
+		VERBOSE("## layer image data begins @ " LL_L("%lld","%ld") "\n", h->layerdatapos);
+
+		// process the layers in 'image data' section,
+		// creating PNG/raw files if requested
+
+		processlayers(f, h);
+
+		// skip 1 byte of padding if we are not at an even position
+		if(ftello(f) & 1)
+			fgetc(f);
+
+		n = globallayermaskinfo(f, h);
+
+		// global 'additional info' (not really documented)
+		// this is found immediately after the 'image data' section
+
+		k = h->lmistart + h->lmilen - ftello(f);
+		if((extra || h->depth > 8) && ftello(f) < (h->lmistart + h->lmilen)){
+			VERBOSE("## global additional info @ %ld (%ld bytes)\n",
+					(long)ftello(f), (long)k);
+
+			if(xml)
+				fputs("\t<GLOBALINFO>\n", xml);
+			
+			doadditional(f, h, 2, k); // write description to XML
+
+			if(xml)
+				fputs("\t</GLOBALINFO>\n", xml);
+		}
+
+		// position file after 'layer & mask info'
+		fseeko(f, h->lmistart + h->lmilen, SEEK_SET);
+		// process merged (composite) image data
+		doimage(f, NULL, base ? base+1 : path, h);
+	}
+
+#ifdef CAN_MMAP
+	if(scavenge_rle && h->nlayers && addr){
+		scan_channels(addr, maplen, h);
+
+		// process scavenged layer channel data
+		for(j = 0; j < h->nlayers; ++j)
+			if(h->linfo[j].chpos){
+				UNQUIET("layer %d: using scavenged pos @ %lu\n", j, (unsigned long)h->linfo[j].chpos);
+
+				strcpy(temp_str, numbered ? h->linfo[j].nameno : h->linfo[j].name);
+				strcat(temp_str, ".scavenged");
+				fseeko(f, h->linfo[j].chpos, SEEK_SET);
+				doimage(f, &h->linfo[j], temp_str, h);
+			}
+	}
+#endif
+
+	if(listfile){
+		fputs("}\n", listfile);
+		fclose(listfile);
+		listfile = NULL;
+	}
+	if(xml){
+		fputs("</PSD>\n", xml);
+		fclose(xml);
+		xml = NULL;
+	}
+	UNQUIET("  done.\n\n");
+
+	if(rebuild || rebuild_v1)
+		rebuild_psd(f, rebuild_v1 ? 1 : h->version, h);
+	if(rebuilt_psd){
+		if(fclose(rebuilt_psd))
+			alwayswarn("### error writing rebuilt PSD\n");
+		rebuilt_psd = NULL;
+	}
+
+#ifdef HAVE_ICONV_H
+	if(ic != (iconv_t)-1) iconv_close(ic);
+	ic = (iconv_t)-1;
+#endif
+	return status;
+}
+
+// Process one input file. Returns FILE_OK, or why not.
+// In --batch, a fatal error only abandons this file.
+
+static int processfile(char *path, struct psd_header *h){
+	psd_file_t f;
+	volatile int status = FILE_INVALID;
+	struct psd_recovery r;
+
+	if( !(f = psd_open(path)) ){
+		alwayswarn("# \"%s\": couldn't open\n", path);
+		return FILE_UNREADABLE;
+	}
+
+	h->arena = NULL;
+	if(!batch)
+		status = processdoc(f, path, h);
+	else{
+		recover_begin(&r);
+		if(!setjmp(r.env))
+			status = processdoc(f, path, h);
+		else{
+			recover_restore(&r);
+
+			// close whatever outputs were open
+			if(listfile){
+				fclose(listfile);
+				listfile = NULL;
+			}
+			if(xml){
+				if(xml != stdout)
+					fclose(xml);
+				xml = NULL;
+			}
+			if(rebuilt_psd){
+				fclose(rebuilt_psd);
+				rebuilt_psd = NULL;
+			}
+#ifdef HAVE_ICONV_H
+			if(ic != (iconv_t)-1) iconv_close(ic);
+			ic = (iconv_t)-1;
+#endif
+		}
+		recover_end(&r);
+	}
+
+	docfree(h);
+	psd_close(f);
+	return status;
+}
+
+// Add the file names listed in a file (one per line; "-" for
+// standard input) to the array of paths, enlarging it as needed.
+
+static char **readlist(char *name, char **paths, int *n, int *size){
+	FILE *lf = strcmp(name, "-") ? fopen(name, "r") : stdin;
+	char line[PATH_MAX+2], **p;
+	size_t len;
+
+	if(!lf)
+		fatal("# can't open list of files\n");
+
+	while(fgets(line, sizeof(line), lf)){
+		len = strlen(line);
+		while(len && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = 0;
+		if(!len)
+			continue;
+
+		if(*n == *size){
+			p = checkmalloc(2 * *size * sizeof(char*));
+			memcpy(p, paths, *n * sizeof(char*));
+			free(paths);
+			paths = p;
+			*size *= 2;
+		}
+		paths[(*n)++] = strcpy(checkmalloc(len+1), line);
+	}
+
+	if(lf != stdin)
+		fclose(lf);
+	return paths;
+}
+
+// Wall clock time in seconds, for --batch.
+
+static double now(void){
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+#else
+	return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+// How many files may be in progress at once, per thread, in --batch.
+#define FILES_IN_FLIGHT 2
+
+static const char *file_status[] = {"ok", "unreadable", "invalid"};
+
+// A file processed by a task, in --batch.
+struct file_job{
+	struct psd_task task;
+#ifdef HAVE_PTHREAD
+	struct psd_capture out;
+#endif
+	char *path; // NULL if this slot is free
+	int status, layers;
+	double secs;
+};
+
+static void filetask(void *arg){
+	struct file_job *j = arg;
+	struct psd_header h;
+	double start = now();
+
+#ifdef HAVE_PTHREAD
+	capture_begin(&j->out);
+#endif
+	h.nlayers = 0;
+	j->status = processfile(j->path, &h);
+	j->layers = h.nlayers;
+#ifdef HAVE_PTHREAD
+	capture_end(&j->out);
+#endif
+	j->secs = now() - start;
+}
+
+// Write a finished file's messages, then its result line.
+
+static void fileresult(struct file_job *j){
+	int warns, errs;
+
+#ifdef HAVE_PTHREAD
+	j->out.errout = 1;
+	capture_replay(&j->out);
+#endif
+	msgcounts(&warns, &errs);
+	printf("%s\t%.3f\t%d\t%d\t%d\t%s\n",
+		   file_status[j->status], j->secs, j->layers, warns, errs, j->path);
+	fflush(stdout);
+}
+
+// Process files as tasks on the worker pool, alongside their layers,
+// so that threads which finish small files move on to others, or help
+// with the layers of big ones. Results are reported as files finish.
+
+static void dobatch(char **paths, int n){
+	struct psd_pool *pool = pool_get();
+	int slots = pool ? FILES_IN_FLIGHT*jobs : 1, busy = 0, next = 0, i, m,
+		*index = checkmalloc(slots*sizeof(int));
+	struct file_job *fj = checkmalloc(slots*sizeof(struct file_job));
+	struct psd_task **running = checkmalloc(slots*sizeof(struct psd_task*));
+
+	for(i = 0; i < slots; ++i)
+		fj[i].path = NULL;
+
+	while(next < n || busy){
+		if(next < n && busy < slots){
+			for(i = 0; fj[i].path; ++i)
+				;
+			fj[i].path = paths[next++];
+#ifdef HAVE_PTHREAD
+			capture_open(&fj[i].out);
+#endif
+			pool_submit(pool, &fj[i].task, TASK_FILE, filetask, fj + i);
+			++busy;
+		}else{
+			for(i = m = 0; i < slots; ++i)
+				if(fj[i].path){
+					running[m] = &fj[i].task;
+					index[m++] = i;
+				}
+			i = index[pool_wait_any(pool, running, m)];
+			fileresult(fj + i);
+			fj[i].path = NULL;
+			--busy;
+		}
+	}
+
+	free(fj);
+	free(running);
+	free(index);
+}
+
 void usage(char *prog, int status){
 	fprintf(stderr, "usage: %s [options] psdfile...\n\
   -h, --help         show this help\n\
@@ -69,7 +419,15 @@ void usage(char *prog, int status){
   -s, --split        write each composite channel to individual (grey scale) PNG\n\
       --mergedonly   process merged composite image only (if available)\n\
       --rebuild      write a new PSD/PSB with extracted image layers only\n\
-        --rebuildpsd    try to rebuild in PSD (v1) format, never PSB (v2)\n"
+        --rebuildpsd    try to rebuild in PSD (v1) format, never PSB (v2)\n\
+  -j, --jobs N       use N threads (layers are processed in parallel)\n\
+  -f, --files list   also process the files named in 'list', one per line\n\
+                     ('-' for standard input)\n\
+  -b, --batch        process files in parallel (with --jobs), and report each\n\
+                     as one line on standard output, when it is done:\n\
+                     status, seconds, layers, warnings, errors, file name\n\
+                     (separated by tabs; status is ok, unreadable or invalid).\n\
+                     Any other messages go to standard error\n"
 #ifdef CAN_MMAP
 "      --scavenge     ignore file header, search entire file for image layers\n\
          --psb           for scavenge, assume PSB (default PSD)\n\
@@ -111,6 +469,9 @@ int main(int argc, char *argv[]){
 		{"rebuild",    no_argument, &rebuild, 1},
 		{"rebuildpsd", no_argument, &rebuild_v1, 1},
 		{"mergedonly", no_argument, &merged_only, 1},
+		{"jobs",       required_argument, NULL, 'j'},
+		{"batch",      no_argument, &batch, 1},
+		{"files",      required_argument, NULL, 'f'},
 		// special purpose options
 		{"memlimit",   required_argument, NULL, 'X'},
 		{"cpulimit",   required_argument, NULL, 'Y'},
@@ -126,21 +487,14 @@ int main(int argc, char *argv[]){
 #endif
 		{NULL,0,NULL,0}
 	};
-	FILE *f;
-	int i, j, indexptr, opt, fd, map_flag;
+	int i, indexptr, opt, npaths = 0, size;
 	struct psd_header h;
-	psd_bytes_t k;
-	char *base;
-	void *addr = NULL;
-	char temp_str[PATH_MAX];
+	char *listname = NULL, **paths = NULL;
 #ifdef HAVE_SETRLIMIT
 	struct rlimit rlp;
 #endif
-#ifdef CAN_MMAP
-	struct stat sb;
-#endif
 
-	while( (opt = getopt_long(argc, argv, "hVvqrewnd:mlxs", longopts, &indexptr)) != -1 )
+	while( (opt = getopt_long(argc, argv, "hVvqrewnd:mlxsj:bf:", longopts, &indexptr)) != -1 )
 		switch(opt){
 		case 0: break; // long option
 		case 'h': help = 1; break;
@@ -164,6 +518,12 @@ int main(int argc, char *argv[]){
 		case 'l': writelist = 1; break;
 		case 'x': writexml = 1; break;
 		case 's': split = 1; break;
+		case 'j':
+			if((jobs = atoi(optarg)) < 1)
+				jobs = 1;
+			break;
+		case 'b': batch = 1; break;
+		case 'f': listname = optarg; break;
 		case 'D': scavenge_depth = atoi(optarg); break;
 		case 'M': scavenge_mode  = atoi(optarg); break;
 		case 'R': scavenge_rows  = atoi(optarg); break;
@@ -173,7 +533,8 @@ int main(int argc, char *argv[]){
 		// Note that these are generally not enforced on OS X!
 		// see: http://lists.apple.com/archives/unix-porting/2005/Jun/msg00115.html
 		case 'X': // set limit on size of memory (megabytes)
-			rlp.rlim_cur = rlp.rlim_max = atoi(optarg) << 20;
+			memlimit = (size_t)atoi(optarg) << 20;
+			rlp.rlim_cur = rlp.rlim_max = memlimit;
 			if(setrlimit(RLIMIT_AS, &rlp) != 0)
 				fatal("# failed to set memory limit\n");
 			break;
@@ -186,151 +547,33 @@ int main(int argc, char *argv[]){
 		default:  usage(argv[0], EXIT_FAILURE);
 		}
 
-	if(optind >= argc)
+	if(optind >= argc && !listname)
 		usage(argv[0], EXIT_FAILURE);
 	else if(help)
 		usage(argv[0], EXIT_SUCCESS);
+	else if(batch && xmlout)
+		fatal("# --xmlout can't be used with --batch\n");
+
+	jobs = mem_jobs(jobs);
+
+	if(optind < argc || listname){
+		npaths = argc - optind;
+		size = npaths + 16;
+		paths = checkmalloc(size*sizeof(char*));
+		memcpy(paths, argv + optind, npaths*sizeof(char*));
+		if(listname)
+			paths = readlist(listname, paths, &npaths, &size);
+	}
 
-	for(i = optind; i < argc; ++i){
-		if( (f = fopen(argv[i], "rb")) ){
-			nwarns = 0;
-
-			if(!quiet && !xmlout)
-				printf("Processing \"%s\"\n", argv[i]);
-
-			base = strrchr(argv[i], DIRSEP);
-
-			h.version = h.nlayers = 0;
-			h.layerdatapos = 0;
-
-#ifdef CAN_MMAP
-			// need to memory map the file, for scavenging routines?
-			fd = fileno(f);
-			map_flag = (scavenge || scavenge_psb || scavenge_rle)
-					   && fstat(fd, &sb) == 0
-					   && (sb.st_mode & S_IFMT) == S_IFREG;
-			if(map_flag && !(addr = map_file(fd, sb.st_size)))
-				fprintf(stderr, "mmap() failed: %d\n", errno);
-
-			if((scavenge || scavenge_psb) && addr)
-			{
-				h.version = 1 + scavenge_psb;
-				h.channels = scavenge_chan;
-				h.rows = scavenge_rows;
-				h.cols = scavenge_cols;
-				h.depth = scavenge_depth;
-				h.mode = scavenge_mode;
-				scavenge_psd(addr, sb.st_size, &h);
-
-				openfiles(argv[i], &h);
-
-				if(xml){
-					fputs("<PSD FILE='", xml);
-					fputsxml(argv[i], xml);
-					fputs("'>\n", xml);
-				}
-
-				for(j = 0; j < h.nlayers; ++j){
-					fseeko(f, h.linfo[j].filepos, SEEK_SET);
-					readlayerinfo(f, &h, j);
-				}
-
-				h.layerdatapos = ftello(f);
-
-				// Layer content starts immediately after the last layer's 'metadata'.
-				// If we did not correctly locate the *last* layer, we are not going to
-				// succeed in extracting data for any layer.
-				processlayers(f, &h);
-
-				// if no layers found, try to locate merged data
-				if(!h.nlayers && h.rows && h.cols && h.lmistart){
-					// position file after 'layer & mask info'
-					fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
-					// process merged (composite) image data
-					doimage(f, NULL, base ? base+1 : argv[i], &h);
-				}
-			}
-			else
-#endif
-
-			if(dopsd(f, argv[i], &h)){
-				psd_bytes_t n;
-
-				VERBOSE("## layer image data begins @ " LL_L("%lld","%ld") "\n", h.layerdatapos);
-
-				// process the layers in 'image data' section,
-				// creating PNG/raw files if requested
-
-				processlayers(f, &h);
-
-				// skip 1 byte of padding if we are not at an even position
-				if(ftello(f) & 1)
-					fgetc(f);
-
-				n = globallayermaskinfo(f, &h);
-
-				// global 'additional info' (not really documented)
-				// this is found immediately after the 'image data' section
-
-				k = h.lmistart + h.lmilen - ftello(f);
-				if((extra || h.depth > 8) && ftello(f) < (h.lmistart + h.lmilen)){
-					VERBOSE("## global additional info @ %ld (%ld bytes)\n",
-							(long)ftello(f), (long)k);
-
-					if(xml)
-						fputs("\t<GLOBALINFO>\n", xml);
-					
-					doadditional(f, &h, 2, k); // write description to XML
-
-					if(xml)
-						fputs("\t</GLOBALINFO>\n", xml);
-				}
-
-				// position file after 'layer & mask info'
-				fseeko(f, h.lmistart + h.lmilen, SEEK_SET);
-				// process merged (composite) image data
-				doimage(f, NULL, base ? base+1 : argv[i], &h);
-			}
-
-#ifdef CAN_MMAP
-			if(scavenge_rle && h.nlayers && addr){
-				scan_channels(addr, sb.st_size, &h);
-
-				// process scavenged layer channel data
-				for(j = 0; j < h.nlayers; ++j)
-					if(h.linfo[j].chpos){
-						UNQUIET("layer %d: using scavenged pos @ %lu\n", j, (unsigned long)h.linfo[j].chpos);
-
-						strcpy(temp_str, numbered ? h.linfo[j].nameno : h.linfo[j].name);
-						strcat(temp_str, ".scavenged");
-						fseeko(f, h.linfo[j].chpos, SEEK_SET);
-						doimage(f, &h.linfo[j], temp_str, &h);
-					}
-			}
-
-			if(map_flag)
-				unmap_file(addr, sb.st_size); // needed for Windows cleanup, even if mmap() failed
-#endif
-
-			if(listfile){
-				fputs("}\n", listfile);
-				fclose(listfile);
-			}
-			if(xml){
-				fputs("</PSD>\n", xml);
-				fclose(xml);
-			}
-			UNQUIET("  done.\n\n");
-
-			if(rebuild || rebuild_v1)
-				rebuild_psd(f, rebuild_v1 ? 1 : h.version, &h);
+	if(batch)
+		dobatch(paths, npaths);
+	else
+		for(i = 0; i < npaths; ++i)
+			processfile(paths[i], &h);
 
-#ifdef HAVE_ICONV_H
-			if(ic != (iconv_t)-1) iconv_close(ic);
-#endif
-			fclose(f);
-		}else
-			alwayswarn("# \"%s\": couldn't open\n", argv[i]);
-	}
+	// the names read from a list were allocated; the others are argv's
+	for(i = argc - optind; i < npaths; ++i)
+		free(paths[i]);
+	free(paths);
 	return EXIT_SUCCESS;
 }
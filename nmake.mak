@@ -77,7 +77,7 @@ PNGOBJ = $(LIBPNG)\png.obj $(LIBPNG)\pngerror.obj $(LIBPNG)\pngget.obj \
 OBJ = main.obj writepng.obj writeraw.obj unpackbits.obj write.obj \
       resources.obj icc.obj extra.obj constants.obj util.obj descriptor.obj \
       channel.obj psd.obj scavenge.obj pdf.obj psd_zip.obj mmap_win.obj \
-      packbits.obj duotone.obj rebuild.obj \
+      packbits.obj duotone.obj rebuild.obj io.obj pool.obj \
       getopt.obj getopt1.obj \
       version.res \
       $(ZLIBOBJ) $(PNGOBJ)
@@ -85,6 +85,7 @@ OBJ = main.obj writepng.obj writeraw.obj unpackbits.obj write.obj \
 PSD2XCF_OBJ = psd2xcf.obj xcf.obj \
 	  unpackbits.obj resources.obj icc.obj extra.obj constants.obj \
 	  util.obj descriptor.obj channel.obj psd.obj pdf.obj psd_zip.obj \
+      io.obj pool.obj mmap_win.obj \
       getopt.obj getopt1.obj \
       version.res
 
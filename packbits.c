@@ -28,7 +28,76 @@
 // i.e. worst case output length is not more than 129*ceil(n/128)
 // or slightly tighter, 129*floor(n/128) + 1 + (n%128)
 
-psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
+/* The encoder makes the same choices whichever variant runs, so output
+ * is byte-identical; the SSE2 variant only finds the end of a run,
+ * or the start of the next one, 16 bytes per compare. (Runs are at most
+ * 128 bytes, too short for AVX2 to pay for itself.)
+ * As with unpackbits(), the variant is chosen at runtime, on first call.
+ */
+
+#ifdef HAVE_VECTOR_EXT
+
+// Index of the first nonzero byte in a compare result, or -1 if none.
+// (Little-endian: the lowest addressed byte is least significant.)
+
+typedef uint64_t vec16q __attribute__((vector_size(16)));
+
+static ALWAYS_INLINE int firstset16(vec16q m){
+	return m[0] ? __builtin_ctzll(m[0])/8
+		 : m[1] ? 8 + __builtin_ctzll(m[1])/8 : -1;
+}
+
+#endif
+
+// Step p forward while it is before lim and matches val.
+
+static ALWAYS_INLINE unsigned char *matchend(unsigned char *p, unsigned char *lim,
+											 unsigned char val, const int chunk)
+{
+#ifdef HAVE_VECTOR_EXT
+	int k;
+
+	if(chunk == 16){
+		vec16 v = (vec16){0} + val;
+		for(; lim-p >= 16; p += 16){
+			if((k = firstset16((vec16q)(*(vec16*)p != v))) >= 0)
+				return p + k;
+		}
+	}
+#endif
+	while(p < lim && *p == val)
+		++p;
+	return p;
+}
+
+// Step p forward until lim, or until three duplicated values begin at p.
+// Bytes at or beyond dataend are never read.
+
+static ALWAYS_INLINE unsigned char *tripleat(unsigned char *p, unsigned char *lim,
+											 unsigned char *dataend, const int chunk)
+{
+#ifdef HAVE_VECTOR_EXT
+	int k;
+
+	if(chunk == 16){
+		for(; lim-p >= 16 && dataend-p >= 16+2; p += 16){
+			vec16 a = *(vec16*)p;
+			if((k = firstset16((vec16q)((a == *(vec16*)(p+1)) & (a == *(vec16*)(p+2))))) >= 0)
+				return p + k;
+		}
+	}
+#endif
+	for(; p < lim; ++p)
+		if(p <= (dataend-3) && p[1] == p[0] && p[2] == p[0])
+			break; // 3 bytes repeated end verbatim run
+	return p;
+}
+
+// Encoder shared by both variants. 'chunk' is a constant (0 for scalar).
+
+static ALWAYS_INLINE psd_pixels_t pack(unsigned char *src, unsigned char *dst,
+									   psd_pixels_t n, const int chunk)
+{
 	unsigned char *p, *q, *run, *dataend;
 	int count, maxrun;
 
@@ -40,8 +109,7 @@ psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
 			// 'run' points to at least three duplicated values.
 			// Step forward until run length limit, end of input,
 			// or a non matching byte:
-			for( p = run+3; p < (run+maxrun) && *p == run[0]; )
-				++p;
+			p = matchend(run+3, run+maxrun, run[0], chunk);
 			count = p - run;
 			// replace this run in output with two bytes:
 			*q++ = 1+256-count; /* flag byte, which encodes count (129..254) */
@@ -50,11 +118,7 @@ psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
 			// If the input doesn't begin with at least 3 duplicated values,
 			// then copy the input block, up to the run length limit,
 			// end of input, or until we see three duplicated values:
-			for( p = run; p < (run+maxrun); )
-				if(p <= (dataend-3) && p[1] == p[0] && p[2] == p[0])
-					break; // 3 bytes repeated end verbatim run
-				else
-					++p;
+			p = tripleat(run+1, run+maxrun, dataend, chunk);
 			count = p - run;
 			*q++ = count-1;        /* flag byte, which encodes count (0..127) */
 			memcpy(q, run, count); /* followed by the bytes in the run */
@@ -63,3 +127,46 @@ psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
 	}
 	return q - dst;
 }
+
+static psd_pixels_t pack_scalar(unsigned char *src, unsigned char *dst, psd_pixels_t n){
+	return pack(src, dst, n, 0);
+}
+
+#ifdef HAVE_VECTOR_EXT
+
+static TARGET_SSE2 psd_pixels_t pack_sse2(unsigned char *src, unsigned char *dst, psd_pixels_t n){
+	return pack(src, dst, n, 16);
+}
+
+#endif
+
+static psd_pixels_t (*pack_fn)(unsigned char *src, unsigned char *dst, psd_pixels_t n);
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Choose the fastest encoder this CPU supports (see choose_unpack()).
+
+static void choose_pack(void){
+#ifdef HAVE_VECTOR_EXT
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+		pack_fn = pack_sse2;
+	else
+#endif
+		pack_fn = pack_scalar;
+}
+
+// Compress n bytes from src into dst, which must have room for
+// PACKBITSWORST(n) bytes. Returns the compressed length.
+
+psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n){
+#ifdef HAVE_PTHREAD
+	pthread_once(&pack_once, choose_pack);
+#else
+	if(!pack_fn)
+		choose_pack();
+#endif
+	return pack_fn(src, dst, n);
+}
@@ -171,8 +171,8 @@ size_t pdf_name(char **p, char *outbuf, size_t n){
 	return cnt;
 }
 
-static char *name_stack[MAX_NAMES];
-static unsigned name_tos, in_array;
+static THREAD_LOCAL char *name_stack[MAX_NAMES];
+static THREAD_LOCAL unsigned name_tos, in_array;
 
 void push_name(char *tag){
 	if(name_tos == MAX_NAMES)
@@ -88,6 +88,19 @@ off_t pl_ftello(psd_file_t f){
 	return getfpos_large(f, &pos) ? -1 : pos;
 }
 
+// The plugin is single threaded, so a positional read
+// can simply seek, read, and restore the file mark.
+size_t pl_pread(psd_file_t f, void *ptr, size_t n, off_t pos){
+	FILECOUNT count = n;
+	off_t savepos = pl_ftello(f);
+
+	if(pl_fseeko(f, pos, SEEK_SET))
+		return 0;
+	fsread_large(f, &count, ptr);
+	pl_fseeko(f, savepos, SEEK_SET);
+	return count;
+}
+
 int pl_feof(psd_file_t f){
 	FILEPOS eof;
 	return !geteof_large(f, &eof) && pl_ftello(f) >= eof;
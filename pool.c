@@ -0,0 +1,259 @@
+/*
+    This file is part of "psdparse"
+    Copyright (C) 2004-2012 Toby Thain, toby@telegraphics.com.au
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Worker threads.
+ *
+ * With --jobs N, independent work (such as writing the images of
+ * several layers, or processing several files) is spread over N threads:
+ * the main thread, and a pool of N-1 workers, created on first use and
+ * kept until exit.
+ *
+ * Each task has a level: TASK_SHORT for a piece of work which never
+ * waits for queued tasks (such as decoding a band of rows, or compressing
+ * a chunk of a PNG), TASK_LAYER for a layer's image, which waits for
+ * short tasks, and TASK_FILE for a whole file, which waits for its layers.
+ * There is a queue per level, run in the order submitted; idle workers
+ * take from the lowest level first, so as to finish work already begun.
+ *
+ * A thread waiting for a task runs queued tasks of the same or lower
+ * level meanwhile, so that it is never idle while the task it needs is
+ * queued. A layer never starts inside another layer's image (which is
+ * why a thread's PNG state can be per thread), but a file waiting for
+ * its layers may take on the layers of other files.
+ *
+ * A task runs with no fatal error recovery (see recover_begin()): a
+ * fatal error in a task belonging to another thread's file can't return
+ * there, so it exits as it would without --batch.
+ *
+ * Where threads are not available (no HAVE_PTHREAD), or jobs <= 1,
+ * there is no pool: pool_get() returns NULL, and a task is simply
+ * run when it is submitted.
+ */
+
+#include "psdparse.h"
+
+#ifdef HAVE_PTHREAD
+
+struct psd_pool{
+	pthread_mutex_t lock;
+	pthread_cond_t work; // signalled when a task is queued
+	pthread_cond_t done; // broadcast when a task is finished
+	struct psd_task *head[TASK_LEVELS], *tail[TASK_LEVELS]; // queued tasks
+};
+
+static THREAD_LOCAL int *pending; // see pool_track()
+
+// Run the first queued task of level <= max, if there is one.
+// Called with the lock held.
+
+static int runtask(struct psd_pool *p, int max){
+	struct psd_task *t;
+	jmp_buf *save;
+	int level, *savepending;
+
+	for(level = 0; level <= max && !p->head[level]; ++level)
+		;
+	if(level > max)
+		return 0;
+
+	t = p->head[level];
+	if(!(p->head[level] = t->next))
+		p->tail[level] = NULL;
+
+	pthread_mutex_unlock(&p->lock);
+	save = fatal_jmp;
+	savepending = pending;
+	fatal_jmp = NULL;
+	pending = NULL;
+	t->run(t->arg);
+	fatal_jmp = save;
+	pending = savepending;
+	pthread_mutex_lock(&p->lock);
+
+	t->done = 1;
+	if(t->pending)
+		--*t->pending;
+	pthread_cond_broadcast(&p->done);
+	return 1;
+}
+
+static void *worker(void *arg){
+	struct psd_pool *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	for(;;)
+		if(!runtask(p, TASK_LEVELS-1))
+			pthread_cond_wait(&p->work, &p->lock);
+	return NULL;
+}
+
+static struct psd_pool *pool_new(int threads){
+	struct psd_pool *p = checkmalloc(sizeof(struct psd_pool));
+	pthread_t tid;
+	int i;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	for(i = 0; i < TASK_LEVELS; ++i)
+		p->head[i] = p->tail[i] = NULL;
+
+	for(i = 0; i < threads; ++i)
+		if(pthread_create(&tid, NULL, worker, p) == 0)
+			pthread_detach(tid);
+		else{
+			alwayswarn("# could only start %d worker threads\n", i);
+			break;
+		}
+	return p;
+}
+
+#endif
+
+// Return the worker pool, or NULL if work should not be shared.
+// Must first be called by the main thread.
+
+struct psd_pool *pool_get(void){
+#ifdef HAVE_PTHREAD
+	static struct psd_pool *pool;
+
+	if(!pool && jobs > 1)
+		pool = pool_new(jobs - 1);
+	return pool;
+#else
+	return NULL;
+#endif
+}
+
+// Queue a task of the given level, which will call run(arg).
+// With no pool, run it now.
+// The task struct must remain valid until pool_wait() returns.
+
+void pool_submit(struct psd_pool *p, struct psd_task *t, int level, void (*run)(void *arg), void *arg){
+	t->run = run;
+	t->arg = arg;
+	t->level = level;
+	t->done = 0;
+	t->next = NULL;
+	t->pending = NULL;
+#ifdef HAVE_PTHREAD
+	if(p){
+		pthread_mutex_lock(&p->lock);
+		if( (t->pending = pending) )
+			++*pending;
+		if(p->tail[level])
+			p->tail[level]->next = t;
+		else
+			p->head[level] = t;
+		p->tail[level] = t;
+		pthread_cond_signal(&p->work);
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+#endif
+	run(arg);
+	t->done = 1;
+}
+
+// Has the task finished?
+
+int pool_done(struct psd_pool *p, struct psd_task *t){
+#ifdef HAVE_PTHREAD
+	int done;
+
+	if(p){
+		pthread_mutex_lock(&p->lock);
+		done = t->done;
+		pthread_mutex_unlock(&p->lock);
+		return done;
+	}
+#endif
+	return t->done;
+}
+
+// Wait until the task has finished, running other tasks meanwhile.
+
+void pool_wait(struct psd_pool *p, struct psd_task *t){
+	pool_wait_any(p, &t, 1);
+}
+
+// Wait until any of n tasks has finished, and return its index.
+// Tasks up to the highest level of the n may be run meanwhile.
+
+int pool_wait_any(struct psd_pool *p, struct psd_task **t, int n){
+	int i;
+#ifdef HAVE_PTHREAD
+	int max = 0;
+
+	if(p){
+		for(i = 0; i < n; ++i)
+			if(t[i]->level > max)
+				max = t[i]->level;
+
+		pthread_mutex_lock(&p->lock);
+		for(;;){
+			for(i = 0; i < n && !t[i]->done; ++i)
+				;
+			if(i < n)
+				break;
+			if(!runtask(p, max))
+				pthread_cond_wait(&p->done, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+		return i;
+	}
+#endif
+	for(i = 0; i < n && !t[i]->done; ++i)
+		;
+	return i < n ? i : 0;
+}
+
+// Count the tasks which the calling thread submits from now on in *count
+// (or stop counting, if NULL), until they finish; returns the previous
+// count, to be restored. A task starts with none, as it's not part of
+// the work of the thread which happens to run it.
+
+int *pool_track(int *count){
+#ifdef HAVE_PTHREAD
+	int *prev = pending;
+
+	pending = count;
+	return prev;
+#else
+	return NULL;
+#endif
+}
+
+// Wait until the tasks counted in *count have finished, running
+// other tasks meanwhile. Used when a fatal error abandons a file
+// whose tasks may still be running.
+
+void pool_drain(struct psd_pool *p, int *count){
+#ifdef HAVE_PTHREAD
+	if(p){
+		pthread_mutex_lock(&p->lock);
+		// a file's tasks are its layers' work; another file isn't
+		// started here, as it might wait for this file's outputs
+		while(*count)
+			if(!runtask(p, TASK_LAYER))
+				pthread_cond_wait(&p->done, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+	}
+#endif
+}
@@ -20,7 +20,7 @@
 #include "psdparse.h"
 
 char dirsep[] = {DIRSEP,0};
-FILE *listfile = NULL, *xml = NULL;
+THREAD_LOCAL FILE *listfile = NULL, *xml = NULL;
 
 void skipblock(psd_file_t f, char *desc){
 	extern void ir_dump(psd_file_t f, int level, int len, struct dictentry *parent);
@@ -47,19 +47,28 @@ void skipblock(psd_file_t f, char *desc){
  * and also populates the h->linfo[] array.
  */
 
-void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
+// Read the record of layer i. Returns 0 if the file ends within it.
+
+int readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 {
 	psd_bytes_t extralen, extrastart;
 	int j, chid, namelen;
 	char *chidstr, tmp[10];
 	struct layer_info *li = h->linfo + i;
+	struct psd_cursor c;
+
+	cursor_init(&c);
 
 	// process layer record
-	li->top = get4B(f);
-	li->left = get4B(f);
-	li->bottom = get4B(f);
-	li->right = get4B(f);
-	li->channels = get2Bu(f);
+	if(cursor_read(f, &c, 18) < 18){ // the file ends here
+		cursor_free(&c);
+		return 0;
+	}
+	li->top = cur4B(&c);
+	li->left = cur4B(&c);
+	li->bottom = cur4B(&c);
+	li->right = cur4B(&c);
+	li->channels = cur2Bu(&c);
 
 	VERBOSE("\n");
 	UNQUIET("  layer %d: (%4d,%4d,%4d,%4d), %d channels (%4d rows x %4d cols)\n",
@@ -67,32 +76,51 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 			li->bottom-li->top, li->right-li->left);
 
 	if( li->bottom < li->top || li->right < li->left
-	 || li->channels > 64 ) // sanity check
+	 || li->channels < 0 || li->channels > 64 ) // sanity check
 	{
 		alwayswarn("### something's not right about that, trying to skip layer.\n");
 		fseeko(f, 6*li->channels+12, SEEK_CUR);
 		skipblock(f, "layer info: extra data");
+		// leave an empty layer in its place, which has no image data
+		li->top = li->left = li->bottom = li->right = 0;
+		li->channels = 0;
 		li->chan = NULL;
-		li->chindex = NULL;
-		li->nameno = li->name = li->unicode_name = NULL;
+		li->chindex = docmalloc(h, 3*sizeof(int));
+		li->chindex += 3;
+		for(j = -3; j < 0; ++j)
+			li->chindex[j] = -1;
+		li->nameno = docmalloc(h, 16);
+		memset(li->nameno, 0, 16); // rebuild_psd() writes the padding too
+		sprintf(li->nameno, "layer%d", i+1);
+		li->name = li->nameno;
+		li->unicode_name = NULL;
+		li->additionalpos = ftello(f);
+		li->additionallen = 0;
 	}
 	else
 	{
-		li->chan = checkmalloc(li->channels*sizeof(struct channel_info));
-		li->chindex = checkmalloc((li->channels+3)*sizeof(int));
+		li->chan = docmalloc(h, li->channels*sizeof(struct channel_info));
+		li->chindex = docmalloc(h, (li->channels+3)*sizeof(int));
 		li->chindex += 3; // so we can index array from [-3] (hackish)
 
 		for(j = -3; j < li->channels; ++j)
 			li->chindex[j] = -1;
 
+		// The channel table, blend mode, extra data length and
+		// layer mask size are fixed size, so fetch them in one read.
+		extrastart = ftello(f) + li->channels*(2 + PSDBSIZE(h->version)) + 16;
+		cursor_read(f, &c, extrastart + 4 - ftello(f));
+
 		// fetch info on each of the layer's channels
 
 		for(j = 0; j < li->channels; ++j){
-			li->chan[j].id = chid = get2B(f);
-			li->chan[j].length = GETPSDBYTES(f);
+			li->chan[j].id = chid = cur2B(&c);
+			li->chan[j].length = CURPSDBYTES(&c);
+			li->chan[j].length_rebuild = 0; // until rebuild_psd() writes it
 			li->chan[j].rawpos = 0;
 			li->chan[j].rowpos = NULL;
-			li->chan[j].unzipdata = NULL;
+			li->chan[j].zip = NULL;
+			li->chan[j].deferred = NULL;
 
 			if(chid >= -3 && chid < li->channels)
 				li->chindex[chid] = j;
@@ -113,40 +141,40 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 					j, li->chan[j].length, chid, chidstr);
 		}
 
-		fread(li->blend.sig, 1, 4, f);
-		fread(li->blend.key, 1, 4, f);
-		li->blend.opacity = fgetc(f);
-		li->blend.clipping = fgetc(f);
-		li->blend.flags = fgetc(f);
-		fgetc(f); // padding
+		curbytes(&c, li->blend.sig, 4);
+		curbytes(&c, li->blend.key, 4);
+		li->blend.opacity = curbyte(&c);
+		li->blend.clipping = curbyte(&c);
+		li->blend.flags = curbyte(&c);
+		curbyte(&c); // padding
 
 		// process layer's 'extra data' section
 
-		extralen = get4B(f);
-		extrastart = ftello(f);
+		extralen = cur4B(&c);
 		VERBOSE("  (extra data: " LL_L("%lld","%ld") " bytes @ "
 				LL_L("%lld","%ld") ")\n", extralen, extrastart);
 
 		// fetch layer mask data
-		li->mask.size = get4B(f);
+		li->mask.size = cur4B(&c);
 		if(li->mask.size >= 20){
 			off_t skip = li->mask.size;
 			VERBOSE("  (has layer mask)\n");
-			li->mask.top = get4B(f);
-			li->mask.left = get4B(f);
-			li->mask.bottom = get4B(f);
-			li->mask.right = get4B(f);
-			li->mask.default_colour = fgetc(f);
-			li->mask.flags = fgetc(f);
+			cursor_read(f, &c, li->mask.size >= 36 ? 36 : 18);
+			li->mask.top = cur4B(&c);
+			li->mask.left = cur4B(&c);
+			li->mask.bottom = cur4B(&c);
+			li->mask.right = cur4B(&c);
+			li->mask.default_colour = curbyte(&c);
+			li->mask.flags = curbyte(&c);
 			skip -= 18;
 			if(li->mask.size >= 36){
 				VERBOSE("  (has user layer mask)\n");
-				li->mask.real_flags = fgetc(f);
-				li->mask.real_default_colour = fgetc(f);
-				li->mask.real_top = get4B(f);
-				li->mask.real_left = get4B(f);
-				li->mask.real_bottom = get4B(f);
-				li->mask.real_right = get4B(f);
+				li->mask.real_flags = curbyte(&c);
+				li->mask.real_default_colour = curbyte(&c);
+				li->mask.real_top = cur4B(&c);
+				li->mask.real_left = cur4B(&c);
+				li->mask.real_bottom = cur4B(&c);
+				li->mask.real_right = cur4B(&c);
 				skip -= 18;
 			}
 			fseeko(f, skip, SEEK_CUR); // skip remainder
@@ -156,10 +184,10 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 		skipblock(f, "layer blending ranges");
 
 		// layer name
-		li->nameno = checkmalloc(16);
+		li->nameno = docmalloc(h, 16);
 		sprintf(li->nameno, "layer%d", i+1);
 		namelen = fgetc(f);
-		li->name = checkmalloc(PAD4(namelen+1));
+		li->name = docmalloc(h, PAD4(namelen+1));
 		fread(li->name, 1, PAD4(namelen+1)-1, f);
 		li->name[namelen] = 0;
 		if(namelen)
@@ -173,6 +201,9 @@ void readlayerinfo(psd_file_t f, struct psd_header *h, int i)
 		// leave file positioned after extra data
 		fseeko(f, extrastart + extralen, SEEK_SET);
 	}
+
+	cursor_free(&c);
+	return 1;
 }
 
 void dolayerinfo(psd_file_t f, struct psd_header *h){
@@ -192,12 +223,72 @@ void dolayerinfo(psd_file_t f, struct psd_header *h){
 	//	return;
 	//}
 
-	h->linfo = checkmalloc(h->nlayers*sizeof(struct layer_info));
+	h->linfo = docmalloc(h, h->nlayers*sizeof(struct layer_info));
 
 	// load linfo[] array with each layer's info
 
 	for(i = 0; i < h->nlayers; ++i)
-		readlayerinfo(f, h, i);
+		if(!readlayerinfo(f, h, i)){
+			alwayswarn("### file ends in layer records, only %d of %d layers found\n", i, h->nlayers);
+			h->nlayers = i;
+			break;
+		}
+
+	// layer image data follows immediately
+	layeroffsets(h, ftello(f));
+}
+
+/**
+ * Compute the file offset of each layer's image data, and of each of
+ * its channels, from the channel lengths in the layer records.
+ * Layer image data is stored consecutively from 'pos', in layer order,
+ * so any layer can then be located without reading those before it.
+ *
+ * Returns the offset following the last layer's image data.
+ */
+
+psd_bytes_t layeroffsets(struct psd_header *h, psd_bytes_t pos){
+	int i, j;
+
+	for(i = 0; i < h->nlayers; ++i){
+		struct layer_info *li = &h->linfo[i];
+
+		li->imagepos = pos;
+		if(li->chan) // NULL if layer record was bad
+			for(j = 0; j < li->channels; ++j){
+				li->chan[j].filepos = pos;
+				pos += li->chan[j].length;
+			}
+	}
+	return pos;
+}
+
+/**
+ * Release the document's metadata (layers and channels), which was
+ * allocated from its arena by docmalloc(), and any inflate state of
+ * its channels.
+ */
+
+void docfree(struct psd_header *h){
+	extern THREAD_LOCAL char *last_layer_name;
+	int i, j;
+
+	if(h->linfo)
+		for(i = 0; i < h->nlayers; ++i)
+			if(h->linfo[i].chan)
+				for(j = 0; j < h->linfo[i].channels; ++j)
+					psd_zip_close(h->linfo[i].chan[j].zip);
+	if(h->merged_chans)
+		for(j = 0; j < h->channels; ++j)
+			psd_zip_close(h->merged_chans[j].zip);
+
+	// a Unicode name not belonging to a layer (e.g. in global additional info)
+	free(last_layer_name);
+	last_layer_name = NULL;
+
+	arena_free(&h->arena);
+	h->linfo = NULL;
+	h->merged_chans = NULL;
 }
 
 void dolayermaskinfo(psd_file_t f, struct psd_header *h){
@@ -250,58 +341,165 @@ psd_bytes_t globallayermaskinfo(psd_file_t f, struct psd_header *h){
 }
 
 /**
- * Loop over all layers described by layer info section,
- * spit out a line in asset list if requested, and call
- * doimage() to process its image data.
+ * Describe a layer: spit out a line in asset list if requested,
+ * begin its XML element, and process its 'additional data'.
+ * Returns the name to be used for its image files.
  */
 
-void processlayers(psd_file_t f, struct psd_header *h)
+static char *layerstart(psd_file_t f, struct psd_header *h, int i)
 {
-	int i;
+	struct layer_info *li = &h->linfo[i];
+	psd_pixels_t cols = li->right - li->left, rows = li->bottom - li->top;
 	psd_bytes_t savepos;
-	extern char *last_layer_name;
+	extern THREAD_LOCAL char *last_layer_name;
 
-	if(listfile) fputs("assetlist = {\n", listfile);
+	VERBOSE("\n  layer %d (\"%s\"):\n", i, li->name);
 
-	for(i = 0; i < h->nlayers; ++i){
-		struct layer_info *li = &h->linfo[i];
-		psd_pixels_t cols = li->right - li->left, rows = li->bottom - li->top;
+	if(listfile && cols && rows){
+		if(numbered)
+			fprintf(listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} }, -- %s\n",
+					li->nameno, li->left, li->top, cols, rows, li->name);
+		else
+			fprintf(listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} },\n",
+					li->name, li->left, li->top, cols, rows);
+	}
+	if(xml){
+		fputs("\t<LAYER NAME='", xml);
+		fputsxml(li->name, xml); // FIXME: what encoding is this in? maybe PDF Latin?
+		fprintf(xml, "' TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' WIDTH='%u' HEIGHT='%u'>\n",
+				li->top, li->left, li->bottom, li->right, cols, rows);
+	}
 
-		VERBOSE("\n  layer %d (\"%s\"):\n", i, li->name);
+	layerblendmode(f, 2, 1, &li->blend);
 
-		if(listfile && cols && rows){
-			if(numbered)
-				fprintf(listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} }, -- %s\n",
-						li->nameno, li->left, li->top, cols, rows, li->name);
-			else
-				fprintf(listfile, "\t\"%s\" = { pos={%4d,%4d}, size={%4u,%4u} },\n",
-						li->name, li->left, li->top, cols, rows);
-		}
-		if(xml){
-			fputs("\t<LAYER NAME='", xml);
-			fputsxml(li->name, xml); // FIXME: what encoding is this in? maybe PDF Latin?
-			fprintf(xml, "' TOP='%d' LEFT='%d' BOTTOM='%d' RIGHT='%d' WIDTH='%u' HEIGHT='%u'>\n",
-					li->top, li->left, li->bottom, li->right, cols, rows);
-		}
+	last_layer_name = NULL;
+	if(extra || unicode_filenames){
+		// Process 'additional data' (non-image layer data,
+		// such as adjustments, effects, type tool).
+
+		savepos = ftello(f);
+		fseeko(f, li->additionalpos, SEEK_SET);
 
-		layerblendmode(f, 2, 1, &li->blend);
+		UNQUIET("Layer %d additional data:\n", i);
+		doadditional(f, h, 2, li->additionallen);
 
+		fseeko(f, savepos, SEEK_SET); // restore file position
+	}
+	// keep the name with the document, so it is freed by docfree()
+	li->unicode_name = NULL;
+	if(last_layer_name){
+		li->unicode_name = strcpy(docmalloc(h, strlen(last_layer_name)+1), last_layer_name);
+		free(last_layer_name);
 		last_layer_name = NULL;
-		if(extra || unicode_filenames){
-			// Process 'additional data' (non-image layer data,
-			// such as adjustments, effects, type tool).
+	}
+
+	return unicode_filenames && li->unicode_name ? li->unicode_name : (numbered ? li->nameno : li->name);
+}
+
+#ifdef HAVE_PTHREAD
+
+// How many layers may be in progress at once, per thread.
+// Output of finished layers is held until earlier layers are done.
+#define LAYERS_IN_FLIGHT 4
 
-			savepos = ftello(f);
-			fseeko(f, li->additionalpos, SEEK_SET);
+// A layer whose image is processed by a worker thread.
+struct layer_job{
+	struct psd_task task;
+	struct psd_capture out;
+	psd_file_t f; // own handle on the input
+	struct psd_header *h;
+	struct layer_info *li;
+	char *name;
+	psd_bytes_t endpos; // file offset following layer's image data
+};
 
-			UNQUIET("Layer %d additional data:\n", i);
-			doadditional(f, h, 2, li->additionallen);
+static void layertask(void *arg){
+	struct layer_job *j = arg;
+
+	capture_begin(&j->out);
+
+	fseeko(j->f, j->li->imagepos, SEEK_SET);
+	if(j->li->chan) // NULL if layer record was bad
+		doimage(j->f, j->li, j->name, j->h);
+	j->endpos = ftello(j->f);
+
+	if(xml) fputs("\t</LAYER>\n\n", xml);
+
+	capture_end(&j->out);
+	psd_close(j->f);
+}
 
-			fseeko(f, savepos, SEEK_SET); // restore file position
+// As processlayers(), but the layers' images are processed in parallel
+// (decoding channels, writing PNGs) on separate handles of the input.
+// Everything else, including output to XML, list and console,
+// happens in layer order, as it would with one thread.
+
+static void parallellayers(psd_file_t f, struct psd_header *h, struct psd_pool *pool)
+{
+	struct layer_job *lj = checkmalloc(h->nlayers*sizeof(struct layer_job));
+	int i, next = 0;
+
+	for(i = 0; i < h->nlayers; ++i){
+		// Replay output of layers done so far, in order;
+		// wait for the earliest if too many are in progress.
+		while(next < i && (i - next >= LAYERS_IN_FLIGHT*jobs || pool_done(pool, &lj[next].task))){
+			pool_wait(pool, &lj[next].task);
+			capture_replay(&lj[next++].out);
 		}
-		li->unicode_name = last_layer_name;
 
-		doimage(f, li, unicode_filenames && last_layer_name ? last_layer_name : (numbered ? li->nameno : li->name), h);
+		capture_open(&lj[i].out);
+		capture_begin(&lj[i].out);
+		lj[i].name = layerstart(f, h, i);
+		capture_end(&lj[i].out);
+
+		lj[i].f = psd_dup(f);
+		lj[i].h = h;
+		lj[i].li = &h->linfo[i];
+		pool_submit(pool, &lj[i].task, TASK_LAYER, layertask, lj + i);
+	}
+
+	for(; next < h->nlayers; ++next){
+		pool_wait(pool, &lj[next].task);
+		capture_replay(&lj[next].out);
+	}
+
+	// leave file where the last layer's image data ends, as doimage() would
+	fseeko(f, lj[h->nlayers-1].endpos, SEEK_SET);
+	free(lj);
+}
+
+#endif
+
+/**
+ * Loop over all layers described by layer info section,
+ * spit out a line in asset list if requested, and call
+ * doimage() to process its image data.
+ * With --jobs, layers' images are processed in parallel.
+ */
+
+void processlayers(psd_file_t f, struct psd_header *h)
+{
+	int i;
+	char *name;
+#ifdef HAVE_PTHREAD
+	struct psd_pool *pool = pool_get();
+	psd_file_t g;
+#endif
+
+	if(listfile) fputs("assetlist = {\n", listfile);
+
+#ifdef HAVE_PTHREAD
+	if(pool && parallel_layers && h->nlayers > 1 && (g = psd_dup(f))){
+		psd_close(g);
+		parallellayers(f, h, pool);
+	}else
+#endif
+	for(i = 0; i < h->nlayers; ++i){
+		name = layerstart(f, h, i);
+
+		fseeko(f, h->linfo[i].imagepos, SEEK_SET);
+		if(h->linfo[i].chan) // NULL if layer record was bad
+			doimage(f, &h->linfo[i], name, h);
 
 		if(xml) fputs("\t</LAYER>\n\n", xml);
 	}
@@ -321,16 +519,20 @@ void processlayers(psd_file_t f, struct psd_header *h)
 
 int dopsd(psd_file_t f, char *psdpath, struct psd_header *h){
 	int result = 0;
+	struct psd_cursor c;
 
 	// file header
-	fread(h->sig, 1, 4, f);
-	h->version = get2Bu(f);
-	get4B(f); get2B(f); // reserved[6];
-	h->channels = get2Bu(f);
-	h->rows = get4B(f);
-	h->cols = get4B(f);
-	h->depth = get2Bu(f);
-	h->mode = get2Bu(f);
+	cursor_init(&c);
+	cursor_read(f, &c, 26);
+	curbytes(&c, h->sig, 4);
+	h->version = cur2Bu(&c);
+	curskip(&c, 6); // reserved[6];
+	h->channels = cur2Bu(&c);
+	h->rows = cur4B(&c);
+	h->cols = cur4B(&c);
+	h->depth = cur2Bu(&c);
+	h->mode = cur2Bu(&c);
+	cursor_free(&c);
 
 	if(!feof(f) && KEYMATCH(h->sig, "8BPS")){
 		if(h->version == 1
@@ -36,7 +36,8 @@
 int verbose = 0, quiet = 0, rsrc = 1, print_rsrc = 0, resdump = 0, extra = 0,
 	makedirs = 0, numbered = 0, help = 0, split = 0, xmlout = 0,
 	writepng = 0, writelist = 0, writexml = 0, unicode_filenames = 1,
-	use_merged = 0, merged_only = 0, extra_chan, rebuild = 0;
+	use_merged = 0, merged_only = 0, extra_chan, rebuild = 0, jobs = 1,
+	parallel_layers = 0; // layers are written to the XCF in turn
 long hres, vres; // set by doresources()
 char *pngdir;
 off_t xcf_merged_pos, *xcf_chan_pos; // updated by doimage() if merged image is processed
@@ -52,6 +53,7 @@ void usage(char *prog, int status){
   -q, --quiet        work silently\n\
   -c, --rle          RLE compression (default)\n\
   -u, --raw          no compression\n\
+  -j, --jobs N       use N threads (tiles are compressed in parallel)\n\
   -m, --merged       include merged (flattened) image as top layer, if available,\n\
                      and all additional non-layer channels\n\
       --merged-only  process merged image & extra channels, but omit all layers\n", prog);
@@ -68,14 +70,15 @@ int main(int argc, char *argv[]){
 		{"raw",        no_argument, &xcf_compr, 0},
 		{"merged",     no_argument, &use_merged, 1},
 		{"merged-only",no_argument, &merged_only, 1},
+		{"jobs",       required_argument, NULL, 'j'},
 		{NULL,0,NULL,0}
 	};
-	FILE *f;
+	psd_file_t f;
 	struct psd_header h;
 	int arg, i, indexptr, opt;
 	off_t xcf_layers_pos, xcf_channels_pos;
 
-	while( (opt = getopt_long(argc, argv, "hVvqcum", longopts, &indexptr)) != -1 )
+	while( (opt = getopt_long(argc, argv, "hVvqcumj:", longopts, &indexptr)) != -1 )
 		switch(opt){
 		case 0: break; // long option
 		case 'h': help = 1; break;
@@ -88,6 +91,10 @@ int main(int argc, char *argv[]){
 		case 'c': xcf_compr = 1; break;
 		case 'u': xcf_compr = 0; break;
 		case 'm': use_merged = 1; break;
+		case 'j':
+			if((jobs = atoi(optarg)) < 1)
+				jobs = 1;
+			break;
 		default:  usage(argv[0], EXIT_FAILURE);
 		}
 
@@ -97,9 +104,12 @@ int main(int argc, char *argv[]){
 		usage(argv[0], EXIT_SUCCESS);
 
 	for(arg = optind; arg < argc; ++arg){
-		if( (f = fopen(argv[arg], "rb")) ){
+		if( (f = psd_open(argv[arg])) ){
 			h.version = h.nlayers = h.mergedalpha = 0;
 			h.layerdatapos = 0;
+			h.linfo = NULL;
+			h.merged_chans = NULL;
+			h.arena = NULL;
 
 			if(dopsd(f, argv[arg], &h)){
 				if(h.depth != 8){
@@ -132,7 +142,7 @@ int main(int argc, char *argv[]){
 
 					// -------------- Layer pointers --------------
 					// write dummies now, fixup later.
-					xcf_layers_pos = ftello(xcf);
+					xcf_layers_pos = ftello_out(xcf);
 
 					if(use_merged || merged_only)
 						put4xcf(xcf, 0); // slot for merged image layer
@@ -150,7 +160,7 @@ int main(int argc, char *argv[]){
 					// Only process these if merged image has been requested.
 					extra_chan = 0;
 					if(use_merged || merged_only){
-						xcf_channels_pos = ftello(xcf);
+						xcf_channels_pos = ftello_out(xcf);
 						// count how many channels exist in the merged data
 						// beyond the image channels and any alpha channel
 						extra_chan = h.channels - mode_channel_count[h.mode] - h.mergedalpha;
@@ -186,7 +196,7 @@ int main(int argc, char *argv[]){
 					// -------------- Fixup layer pointers --------------
 					// In reverse of the PSD order, since XCF stores
 					// layers top to bottom.
-					fseeko(xcf, xcf_layers_pos, SEEK_SET);
+					fseeko_out(xcf, xcf_layers_pos, SEEK_SET);
 
 					if(use_merged || merged_only)
 						put4xcf(xcf, xcf_merged_pos);
@@ -229,7 +239,8 @@ int main(int argc, char *argv[]){
 				fprintf(stderr, "Not a PSD or PSB file.\n");
 			}
 
-			fclose(f);
+			docfree(&h);
+			psd_close(f);
 		}else{
 			fprintf(stderr, "Could not open: %s\n", argv[arg]);
 		}
@@ -246,7 +257,6 @@ int main(int argc, char *argv[]){
 void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header *h)
 {
 	int ch, i;
-	psd_bytes_t image_data_end;
 
 	/* li points to layer information. If it is NULL, then
 	 * the merged image is being being processed, not a layer. */
@@ -264,15 +274,11 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 				    (long)li->chan[ch].length);
 		}
 
-		image_data_end = ftello(f);
-
-		// xcf_layer() does alter the input PSD file position!
+		// xcf_layer() reads the image data by position only,
+		// so the file is left after the layer's data, as caller expects.
 		li->xcf_pos = li->right > li->left && li->bottom > li->top
 							? xcf_layer(xcf, f, li, xcf_compr)
 							: 0;
-
-		// caller may be assuming this position
-		fseeko(f, image_data_end, SEEK_SET);
 	}
 	else{
 		// The merged image has the size, mode, depth, and channel count
@@ -31,81 +31,510 @@
 #ifdef HAVE_ZLIB_H
 	#include "zlib.h"
 #endif
+#ifdef HAVE_LIBDEFLATE
+	#include <libdeflate.h>
+#endif
+
+/* Whole-buffer inflate: a complete zlib stream, whose uncompressed size
+ * is known, is decoded in one call straight into the caller's buffer.
+ * Decoding in one go, zlib needs no window and does no copying.
+ * An inflater is kept between calls, so repeated decoding (e.g. trying
+ * many offsets when scavenging) doesn't set up zlib's state each time.
+ *
+ * Built with HAVE_LIBDEFLATE, libdeflate is used instead: it can only
+ * decode whole buffers, but does so considerably faster.
+ */
+
+struct psd_inflater{
+#ifdef HAVE_LIBDEFLATE
+	struct libdeflate_decompressor *d;
+#elif defined(HAVE_ZLIB_H)
+	z_stream z;
+	int ready;
+#endif
+};
+
+struct psd_inflater *psd_inflater_new(void){
+	struct psd_inflater *inf = checkmalloc(sizeof(struct psd_inflater));
+
+	memset(inf, 0, sizeof(struct psd_inflater));
+#ifdef HAVE_LIBDEFLATE
+	if(!(inf->d = libdeflate_alloc_decompressor()))
+		fatal("can't allocate decompressor\n");
+#endif
+	return inf;
+}
+
+void psd_inflater_free(struct psd_inflater *inf){
+	if(inf){
+#ifdef HAVE_LIBDEFLATE
+		libdeflate_free_decompressor(inf->d);
+#elif defined(HAVE_ZLIB_H)
+		if(inf->ready)
+			inflateEnd(&inf->z);
+#endif
+		free(inf);
+	}
+}
+
+// Inflate the zlib stream at src (at most src_len bytes) into dst,
+// which has room for dst_len bytes. Returns the number of compressed
+// bytes in the stream if it was complete and valid, otherwise 0.
+// If 'produced' is not NULL, it is set to the number of bytes written.
 
-psd_status psd_unzip_without_prediction(psd_uchar *src_buf, psd_int src_len, 
-	psd_uchar *dst_buf, psd_int dst_len)
+size_t psd_inflate(struct psd_inflater *inf, unsigned char *src, size_t src_len,
+				   unsigned char *dst, size_t dst_len, size_t *produced)
 {
-#ifdef HAVE_ZLIB_H
-	z_stream stream;
-	psd_int state;
-
-	memset(&stream, 0, sizeof(z_stream));
-	stream.data_type = Z_BINARY;
-
-	stream.next_in = (Bytef *)src_buf;
-	stream.avail_in = src_len;
-	stream.next_out = (Bytef *)dst_buf;
-	stream.avail_out = dst_len;
-
-	if(inflateInit(&stream) != Z_OK)
-		return 0;
-	
-	do {
-		state = inflate(&stream, Z_PARTIAL_FLUSH);
-		if(state == Z_STREAM_END)
-			break;
-		if(state == Z_DATA_ERROR || state != Z_OK)
-			break;
-	}  while (stream.avail_out > 0);
+	size_t count = 0, got = 0;
+#ifdef HAVE_LIBDEFLATE
+	if(libdeflate_zlib_decompress_ex(inf->d, src, src_len, dst, dst_len,
+									 &count, &got) != LIBDEFLATE_SUCCESS)
+		count = got = 0; // nothing useful is known of a failed decode
+#elif defined(HAVE_ZLIB_H)
+	if(inf->ready)
+		inflateReset(&inf->z);
+	else{
+		memset(&inf->z, 0, sizeof(z_stream));
+		inf->ready = inflateInit(&inf->z) == Z_OK;
+	}
+	if(inf->ready){
+		inf->z.next_in = src;
+		inf->z.avail_in = src_len < UINT_MAX ? src_len : UINT_MAX;
+		inf->z.next_out = dst;
+		inf->z.avail_out = dst_len < UINT_MAX ? dst_len : UINT_MAX;
+		if(inflate(&inf->z, Z_FINISH) == Z_STREAM_END)
+			count = inf->z.next_in - src;
+		got = inf->z.next_out - dst;
+	}
+#endif
+	if(produced)
+		*produced = got;
+	return count;
+}
+
+/* Undoing the predictor is a running sum along each row: of bytes for
+ * 8-bit data, of big-endian words for 16-bit. 32-bit (float) rows are
+ * predicted as one run of bytes, with the bytes of each sample split
+ * into four planes (most significant first), which must afterwards be
+ * interleaved back into big-endian samples.
+ *
+ * The SSE2 variant sums 16 bytes at a time in log steps; it needs
+ * __builtin_shufflevector, and the scalar variant is the fallback.
+ * As in unpackbits.c, the choice is made at runtime, on first call.
+ */
+
+// Running sum of n bytes.
+
+static ALWAYS_INLINE void sum8(psd_uchar *p, psd_int n, const int chunk){
+	psd_int i = 0;
 
-	if (state != Z_STREAM_END && state != Z_OK)
-		return 0;
+#ifdef HAVE_SHUFFLE
+	if(chunk){
+		vec16 x, zero = {0}, carry = {0};
 
-	return 1;
+		for(; n-i >= 16; i += 16){
+			// add x shifted up by 1, 2, 4 then 8 bytes, then the previous total
+			x = *(vec16*)(p+i);
+			x += __builtin_shufflevector(zero, x, 0,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30);
+			x += __builtin_shufflevector(zero, x, 0,0,16,17,18,19,20,21,22,23,24,25,26,27,28,29);
+			x += __builtin_shufflevector(zero, x, 0,0,0,0,16,17,18,19,20,21,22,23,24,25,26,27);
+			x += __builtin_shufflevector(zero, x, 0,0,0,0,0,0,0,0,16,17,18,19,20,21,22,23);
+			x += carry;
+			*(vec16*)(p+i) = x;
+			carry = __builtin_shufflevector(x, x, 15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15);
+		}
+	}
 #endif
-	return 0;
+	for(i = i ? i : 1; i < n; ++i)
+		p[i] += p[i-1];
 }
 
-psd_status psd_unzip_with_prediction(psd_uchar *src_buf, psd_int src_len, 
-	psd_uchar *dst_buf, psd_int dst_len, 
-	psd_int row_size, psd_int color_depth)
+// Running sum of n big-endian 16-bit samples.
+
+static ALWAYS_INLINE void sum16(psd_uchar *p, psd_int n, const int chunk){
+	psd_int i = 0;
+	psd_uchar *q;
+
+#ifdef HAVE_SHUFFLE
+	if(chunk){
+		vec16w w, zero = {0}, carry = {0};
+
+		for(; n-i >= 8; i += 8){
+			w = (vec16w)*(vec16*)(p+2*i);
+			w = (w << 8) | (w >> 8); // to host order
+			w += __builtin_shufflevector(zero, w, 0,8,9,10,11,12,13,14);
+			w += __builtin_shufflevector(zero, w, 0,0,8,9,10,11,12,13);
+			w += __builtin_shufflevector(zero, w, 0,0,0,0,8,9,10,11);
+			w += carry;
+			*(vec16*)(p+2*i) = (vec16)((w << 8) | (w >> 8));
+			carry = __builtin_shufflevector(w, w, 7,7,7,7,7,7,7,7);
+		}
+	}
+#endif
+	for(i = i ? i : 1; i < n; ++i){
+		q = p + 2*i;
+		q[0] += q[-2] + ((q[-1] + q[1]) >> 8);
+		q[1] += q[-1];
+	}
+}
+
+// Interleave four byte planes of n bytes each (src) into n 4-byte samples.
+
+static ALWAYS_INLINE void interleave32(psd_uchar *dst, psd_uchar *src, psd_int n, const int chunk){
+	psd_int i = 0;
+
+#ifdef HAVE_SHUFFLE
+	if(chunk){
+		vec16 a, b, c, d;
+		vec16w ab, cd;
+
+		for(; n-i >= 16; i += 16){
+			a = *(vec16*)(src+i);
+			b = *(vec16*)(src+n+i);
+			c = *(vec16*)(src+2*n+i);
+			d = *(vec16*)(src+3*n+i);
+
+			ab = (vec16w)__builtin_shufflevector(a, b, 0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23);
+			cd = (vec16w)__builtin_shufflevector(c, d, 0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23);
+			*(vec16*)(dst+4*i)    = (vec16)__builtin_shufflevector(ab, cd, 0,8,1,9,2,10,3,11);
+			*(vec16*)(dst+4*i+16) = (vec16)__builtin_shufflevector(ab, cd, 4,12,5,13,6,14,7,15);
+
+			ab = (vec16w)__builtin_shufflevector(a, b, 8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31);
+			cd = (vec16w)__builtin_shufflevector(c, d, 8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31);
+			*(vec16*)(dst+4*i+32) = (vec16)__builtin_shufflevector(ab, cd, 0,8,1,9,2,10,3,11);
+			*(vec16*)(dst+4*i+48) = (vec16)__builtin_shufflevector(ab, cd, 4,12,5,13,6,14,7,15);
+		}
+	}
+#endif
+	for(; i < n; ++i){
+		dst[4*i]   = src[i];
+		dst[4*i+1] = src[n+i];
+		dst[4*i+2] = src[2*n+i];
+		dst[4*i+3] = src[3*n+i];
+	}
+}
+
+static ALWAYS_INLINE void unpredict(psd_uchar *row, psd_int cols, psd_int depth,
+									psd_uchar *tmp, const int chunk)
 {
+	switch(depth){
+	case 8:
+		sum8(row, cols, chunk);
+		break;
+	case 16:
+		sum16(row, cols, chunk);
+		break;
+	case 32:
+		sum8(row, 4*cols, chunk);
+		interleave32(tmp, row, cols, chunk);
+		memcpy(row, tmp, 4*cols);
+		break;
+	}
+}
+
+static void unpredict_scalar(psd_uchar *row, psd_int cols, psd_int depth, psd_uchar *tmp){
+	unpredict(row, cols, depth, tmp, 0);
+}
+
+#ifdef HAVE_SHUFFLE
+
+static TARGET_SSE2 void unpredict_sse2(psd_uchar *row, psd_int cols, psd_int depth, psd_uchar *tmp){
+	unpredict(row, cols, depth, tmp, 16);
+}
+
+#endif
+
+static void (*unpredict_fn)(psd_uchar *row, psd_int cols, psd_int depth, psd_uchar *tmp);
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t unpredict_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void choose_unpredict(void){
+#ifdef HAVE_SHUFFLE
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+		unpredict_fn = unpredict_sse2;
+	else
+#endif
+		unpredict_fn = unpredict_scalar;
+}
+
+// Undo prediction on one row of 'cols' samples, in place.
+// For 32-bit data, tmp must have room for the row (4*cols bytes);
+// otherwise it is unused. Other depths are never predicted.
+
+void psd_unpredict_row(psd_uchar *row, psd_int cols, psd_int depth, psd_uchar *tmp){
+#ifdef HAVE_PTHREAD
+	pthread_once(&unpredict_once, choose_unpredict);
+#else
+	if(!unpredict_fn)
+		choose_unpredict();
+#endif
+	unpredict_fn(row, cols, depth, tmp);
+}
+
+/* A ZIP channel is inflated as its rows are requested, so only the
+ * inflate window, an input buffer, and the caller's row are in memory.
+ * Rows are produced in order; asking for an earlier row than the last
+ * restarts the stream from the beginning.
+ *
+ * The merged image's channels share one compression field and their
+ * data forms a single stream: a channel's stream then starts by
+ * discarding the data of the channels before it ('skip'). So that this
+ * isn't done over from the beginning for every channel, the inflate
+ * state at the start of each channel is kept (a 'mark'), and the next
+ * channel's stream starts from it. A stream which ends early is followed
+ * into any further zlib stream, so data compressed separately per channel
+ * is handled the same way.
+ */
+
+#define ZIPBUFSIZE 0x10000
+
+struct zip_stream{
+	psd_bytes_t start, len; // compressed data in file (len = 0: runs to end of file)
+	psd_bytes_t skip;       // uncompressed bytes preceding this channel's data
+	psd_bytes_t inpos;      // file offset of next compressed data
+	psd_pixels_t nextrow;   // row which the stream produces next
+	int depth, active, failed;
+	unsigned char *inbuf, *tmp;
+	struct zip_stream *prev; // stream of the preceding channel in the same data
+	int marked, markfailed;  // whether the mark has been made, or couldn't be
+	psd_bytes_t markpos;     // file offset of compressed data following the mark
 #ifdef HAVE_ZLIB_H
-	psd_status status;
-	int len;
-	psd_uchar * buf;
-
-	status = psd_unzip_without_prediction(src_buf, src_len, dst_buf, dst_len);
-	if(!status)
-		return status;
-	
-	buf = dst_buf;
-	do {
-		len = row_size;
-		if (color_depth == 16)
-		{
-			while(--len)
+	z_stream z, mark;
+#endif
+};
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_PTHREAD)
+static pthread_mutex_t mark_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Create the inflate state for a channel whose compressed data is
+// at file offset pos, len bytes long. Nothing is read until
+// the first row is requested. If the channel's data follows that of
+// another channel in the same stream, prev is that channel's stream.
+
+struct zip_stream *psd_zip_open(int depth, psd_bytes_t pos, psd_bytes_t len,
+								psd_bytes_t skip, struct zip_stream *prev)
+{
+	struct zip_stream *zs = checkmalloc(sizeof(struct zip_stream));
+
+	memset(zs, 0, sizeof(struct zip_stream));
+	zs->start = pos;
+	zs->len = len;
+	zs->skip = skip;
+	zs->depth = depth;
+	zs->prev = prev;
+	return zs;
+}
+
+#ifdef HAVE_ZLIB_H
+
+// Release the inflate state and buffers, but keep the description
+// of the data, so the stream can be restarted.
+
+static void zip_end(struct zip_stream *zs){
+	if(zs->active)
+		inflateEnd(&zs->z);
+	free(zs->inbuf);
+	free(zs->tmp);
+	zs->inbuf = zs->tmp = NULL;
+	zs->active = 0;
+}
+
+// Inflate up to n bytes into out, reading compressed data as required.
+// Returns the number of bytes produced, less than n at end of data or
+// on error.
+
+static psd_bytes_t zip_inflate(psd_file_t f, struct zip_stream *zs, unsigned char *out, psd_bytes_t n){
+	psd_bytes_t want;
+	size_t got;
+	int state;
+
+	zs->z.next_out = out;
+	zs->z.avail_out = n;
+	while(zs->z.avail_out){
+		if(!zs->z.avail_in){
+			want = zs->len ? zs->start + zs->len - zs->inpos : ZIPBUFSIZE;
+			if(!want)
+				break; // end of channel data
+#ifndef PSDPARSE_PLUGIN
+			if( (zs->z.next_in = psd_preadptr(f, want < 0x40000000 ? want : 0x40000000,
+											  zs->inpos, &got)) )
+				; // file is in memory; inflate from it directly
+			else
+#endif
 			{
-				buf[2] += buf[0] + ((buf[1] + buf[3]) >> 8);
-				buf[3] += buf[1];
-				buf += 2;
+				if(!zs->inbuf)
+					zs->inbuf = checkmalloc(ZIPBUFSIZE);
+				got = psd_pread(f, zs->inbuf, want < ZIPBUFSIZE ? want : ZIPBUFSIZE, zs->inpos);
+				zs->z.next_in = zs->inbuf;
 			}
-			buf += 2;
-			dst_len -= row_size * 2;
+			if(!got)
+				break; // end of file
+			zs->z.avail_in = got;
+			zs->inpos += got;
 		}
-		else
-		{
-			while(--len)
-			{
-				*(buf + 1) += *buf;
-				buf ++;
-			}
-			buf ++;
-			dst_len -= row_size;
+
+		state = inflate(&zs->z, Z_NO_FLUSH);
+		if(state == Z_STREAM_END){
+			// another stream may follow (e.g. merged data compressed per channel)
+			if(!zs->z.avail_in && zs->len && zs->inpos == zs->start + zs->len)
+				break;
+			inflateReset(&zs->z);
+		}else if(state != Z_OK){
+			warn_msg("ZIP data error: %s", zs->z.msg ? zs->z.msg : "?");
+			break;
+		}
+	}
+	return n - zs->z.avail_out;
+}
+
+// Make the mark of a stream which follows another: starting from the
+// previous stream's mark (made first, if need be), discard the previous
+// channel's data, and keep the inflate state where this channel's begins.
+// This is done on a separate state, as the previous stream may be in use.
+// Returns 0 if the data ran out or was bad. The caller holds mark_lock.
+
+static int zip_mark(psd_file_t f, struct zip_stream *zs, unsigned char *scratch, psd_pixels_t n){
+	struct zip_stream w;
+	psd_bytes_t left = 0, k;
+	int ok;
+
+	if(zs->marked)
+		return !zs->markfailed;
+
+	memset(&w, 0, sizeof(struct zip_stream));
+	w.start = zs->start;
+	w.len = zs->len;
+	if(zs->prev){
+		if(!zip_mark(f, zs->prev, scratch, n))
+			ok = 0;
+		else if( (ok = inflateCopy(&w.z, &zs->prev->mark) == Z_OK) ){
+			w.inpos = zs->prev->markpos;
+			left = zs->skip - zs->prev->skip;
+		}
+	}else{
+		w.z.data_type = Z_BINARY;
+		if( (ok = inflateInit(&w.z) == Z_OK) ){
+			w.inpos = zs->start;
+			left = zs->skip;
+		}
+	}
+
+	if(ok){
+		w.z.next_in = NULL;
+		w.z.avail_in = 0;
+		for(; left && ok; left -= k){
+			k = left < n ? left : n;
+			ok = zip_inflate(f, &w, scratch, k) == k;
 		}
-	} while(dst_len > 0);
+		if(ok && (ok = inflateCopy(&zs->mark, &w.z) == Z_OK))
+			zs->markpos = w.inpos - w.z.avail_in;
+		inflateEnd(&w.z);
+	}
+	free(w.inbuf);
+
+	zs->marked = 1;
+	zs->markfailed = !ok;
+	return ok;
+}
+
+// (Re)start the stream, and discard the data preceding the channel's;
+// for a channel following another, start from its mark instead.
+
+static void zip_start(psd_file_t f, struct zip_stream *zs, unsigned char *scratch, psd_pixels_t n){
+	psd_bytes_t left, k;
+
+	zip_end(zs);
+	memset(&zs->z, 0, sizeof(z_stream));
+	zs->nextrow = 0;
+	if(zs->prev){
+		jmp_buf *save = fatal_jmp;
+
+		fatal_jmp = NULL; // the lock can't be abandoned (see recover_begin())
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&mark_lock);
+#endif
+		zs->failed = !zip_mark(f, zs, scratch, n) || inflateCopy(&zs->z, &zs->mark) != Z_OK;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&mark_lock);
+#endif
+		fatal_jmp = save;
+		zs->active = !zs->failed;
+		zs->inpos = zs->markpos;
+		zs->z.next_in = NULL;
+		zs->z.avail_in = 0;
+		return;
+	}
+
+	zs->z.data_type = Z_BINARY;
+	zs->inpos = zs->start;
+	zs->failed = inflateInit(&zs->z) != Z_OK;
+	zs->active = !zs->failed;
+
+	for(left = zs->skip; left && !zs->failed; left -= k){
+		k = left < n ? left : n;
+		zs->failed = zip_inflate(f, zs, scratch, k) < k;
+	}
+}
 
-	return 1;
 #endif
+
+// Inflate nrows rows of a ZIP channel, starting at 'row', straight into
+// out (nrows*rowbytes in size), undoing prediction if used. Returns the
+// number of bytes produced, which is short if the data ended early or
+// was bad. As the stream is stateful, only one thread may read
+// a channel at once.
+
+psd_bytes_t psd_zip_readrows(psd_file_t f, struct channel_info *chan,
+							 psd_pixels_t row, psd_pixels_t nrows, unsigned char *out)
+{
+#ifdef HAVE_ZLIB_H
+	struct zip_stream *zs = chan->zip;
+	psd_bytes_t n = 0;
+	psd_pixels_t j;
+
+	// start at the first call, or go back; a stream which failed
+	// is not retried until an earlier row is asked for
+	if(row < zs->nextrow || (!zs->active && !zs->failed))
+		zip_start(f, zs, out, chan->rowbytes);
+
+	if(!zs->failed){
+		// skip rows before the one wanted
+		for(; zs->nextrow < row && !zs->failed; ++zs->nextrow)
+			zs->failed = zip_inflate(f, zs, out, chan->rowbytes) < chan->rowbytes;
+
+		if(!zs->failed){
+			n = zip_inflate(f, zs, out, nrows*chan->rowbytes);
+			zs->failed = n < nrows*chan->rowbytes;
+			if(chan->comptype == ZIPPREDICT){
+				if(zs->depth == 32 && !zs->tmp)
+					zs->tmp = checkmalloc(chan->rowbytes);
+				for(j = 0; j < n/chan->rowbytes; ++j)
+					psd_unpredict_row(out + j*chan->rowbytes, chan->cols, zs->depth, zs->tmp);
+			}
+			zs->nextrow = row + nrows;
+		}
+	}
+
+	// the buffers are not needed once the last row is produced
+	if(zs->failed || zs->nextrow == chan->rows)
+		zip_end(zs);
+	return n;
+#else
 	return 0;
+#endif
+}
+
+void psd_zip_close(struct zip_stream *zs){
+	if(zs){
+#ifdef HAVE_ZLIB_H
+		zip_end(zs);
+		if(zs->marked && !zs->markfailed)
+			inflateEnd(&zs->mark);
+#endif
+		free(zs);
+	}
 }
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <setjmp.h>
 
 #if defined(__SC__) || defined(MPW_C)
 	// MPW 68K or PPC
@@ -67,10 +68,21 @@
 	#include <unistd.h>
 #endif
 
+// Worker threads (see pool.c and --jobs). XML output and the warning
+// count are per thread, so that a worker's output can be captured
+// and replayed in order (see capture_begin()).
+#ifdef HAVE_PTHREAD
+	#include <pthread.h>
+
+	#define THREAD_LOCAL __thread
+#else
+	#define THREAD_LOCAL
+#endif
+
 #ifdef HAVE_ICONV_H
 	#include <iconv.h>
 
-	extern iconv_t ic;
+	extern THREAD_LOCAL iconv_t ic;
 #endif
 
 #ifdef PSBSUPPORT
@@ -79,12 +91,14 @@
 
 	typedef uint64_t psd_bytes_t;
 	#define GETPSDBYTES(f) (h->version==1 ? get4B(f) : get8B(f))
+	#define CURPSDBYTES(c) (h->version==1 ? cur4B(c) : cur8B(c))
 
 	// macro chooses the '%ll' version of format strings involving psd_bytes_t type
 	#define LL_L(llfmt,lfmt) llfmt
 #else
 	typedef uint32_t psd_bytes_t;
 	#define GETPSDBYTES get4B
+	#define CURPSDBYTES cur4B
 
 	// macro chooses the '%l' version of format strings involving psd_bytes_t type
 	#define LL_L(llfmt,lfmt) lfmt
@@ -95,6 +109,57 @@
 // N.B. exception: RLE row count array, where counts are 2 bytes & 4 bytes respectively
 #define PSDBSIZE(version) ((version) << 2)
 
+// Byte swapping, for decoding big-endian fields held in memory
+// (see peek4B() etc). Where no intrinsic is known, the peek functions
+// assemble values a byte at a time.
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		#define BSWAP16(x) __builtin_bswap16(x)
+		#define BSWAP32(x) __builtin_bswap32(x)
+		#define BSWAP64(x) __builtin_bswap64(x)
+	#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		#define BSWAP16(x) (x)
+		#define BSWAP32(x) (x)
+		#define BSWAP64(x) (x)
+	#endif
+#elif defined(_MSC_VER)
+	#define BSWAP16(x) _byteswap_ushort(x)
+	#define BSWAP32(x) _byteswap_ulong(x)
+	#define BSWAP64(x) _byteswap_uint64(x)
+#endif
+
+// GCC (and clang) vector extensions, used by the PackBits coders.
+// Code using these is compiled for SSE2 or AVX2 according to the
+// target attribute of the function it is inlined into.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define HAVE_VECTOR_EXT
+	#define ALWAYS_INLINE __inline__ __attribute__((always_inline))
+	#ifdef __x86_64__
+		#define TARGET_SSE2 // always available
+	#else
+		#define TARGET_SSE2 __attribute__((target("sse2")))
+	#endif
+	#define TARGET_SSSE3 __attribute__((target("ssse3")))
+	#define TARGET_AVX2 __attribute__((target("avx2")))
+
+	// unaligned vectors
+	typedef unsigned char vec16 __attribute__((vector_size(16), aligned(1), may_alias));
+	typedef unsigned char vec32 __attribute__((vector_size(32), aligned(1), may_alias));
+
+	// 16 bytes as 16- and 32-bit lanes (in registers only)
+	typedef uint16_t vec16w __attribute__((vector_size(16)));
+	typedef uint32_t vec16d __attribute__((vector_size(16)));
+
+	// __builtin_shufflevector (clang, GCC 12) permits any lane order
+	#ifdef __has_builtin
+		#if __has_builtin(__builtin_shufflevector)
+			#define HAVE_SHUFFLE
+		#endif
+	#endif
+#else
+	#define ALWAYS_INLINE
+#endif
+
 // this is paired with %u format specifications so may break
 // if not same size as 'unsigned'.
 typedef uint32_t psd_pixels_t;
@@ -122,6 +187,8 @@ typedef uint16_t psd_ushort;
 	size_t pl_fread(void *ptr, size_t s, size_t n, psd_file_t f);
 	int pl_fseeko(psd_file_t f, off_t pos, int wh);
 	off_t pl_ftello(psd_file_t f);
+	size_t pl_pread(psd_file_t f, void *ptr, size_t n, off_t pos);
+	#define psd_pread pl_pread
 	void pl_fatal(char *s);
 	void *pl_malloc(size_t n, char *file, int line);
 	void pl_free(void *p, char *file, int line);
@@ -135,9 +202,6 @@ typedef uint16_t psd_ushort;
 		#include <direct.h>
 
 		#define MKDIR(name,mode) _mkdir(name) // laughable, isn't it.
-
-		#define fseeko _fseeki64
-		#define ftello _ftelli64
 	#else
 		#if defined(macintosh) && !defined(HAVE_SYS_STAT_H)
 			// don't clash with OS X header -- this prototype is meant for MPW build.
@@ -146,17 +210,79 @@ typedef uint16_t psd_ushort;
 		#define MKDIR mkdir
 	#endif
 
-	typedef FILE *psd_file_t;
-	#ifdef _MSC_VER
-		#define fseeko _fseeki64
-		#define ftello _ftelli64
+	// Input is read through a small I/O vtable (see io.c), so that the
+	// parser can run from a memory mapped file or an in-memory buffer,
+	// as well as from a stdio stream. As for the plugin build, the stdio
+	// names used by the parser are redirected.
+	typedef struct psd_file *psd_file_t;
+
+	#ifdef PSD_IO_IMPL
+		// io.c implements the stdio backend, so it sees the real thing
+		#ifdef _MSC_VER
+			#define fseeko _fseeki64
+			#define ftello _ftelli64
+		#else
+			#if defined(__SC__) || defined(MPW_C) || defined(_WIN32)
+				#define fseeko fseek
+				#define ftello ftell
+			#endif
+		#endif
 	#else
-		#if defined(__SC__) || defined(MPW_C) || defined(_WIN32)
-			#define fseeko fseek
-			#define ftello ftell
+		#define fgetc psd_fgetc
+		#define fread psd_fread
+		#define fseeko psd_fseeko
+		#define ftello psd_ftello
+		#undef feof
+		#define feof psd_feof
+
+		#ifdef HAVE_PTHREAD
+			// console output too, so that it can be captured
+			#define printf psd_printf
+			#define putchar psd_putchar
 		#endif
 	#endif
 
+	struct psd_io{
+		int (*getbyte)(psd_file_t f);
+		size_t (*read)(void *ptr, size_t n, psd_file_t f);
+		int (*seek)(psd_file_t f, off_t pos, int wh);
+		off_t (*tell)(psd_file_t f);
+		int (*eof)(psd_file_t f);
+		void (*close)(psd_file_t f);
+		size_t (*pread)(psd_file_t f, void *ptr, size_t n, off_t pos);
+	};
+
+	struct psd_file{
+		const struct psd_io *io;
+		FILE *fp;            // underlying stream (NULL for memory buffer)
+		unsigned char *base; // mapped or buffered data (NULL for stdio)
+		psd_bytes_t size, pos;
+		int eof;             // set when a read runs past end of data
+	};
+
+	psd_file_t psd_open(char *path);
+	psd_file_t psd_open_mem(void *buf, size_t len);
+	psd_file_t psd_dup(psd_file_t f);
+	void psd_close(psd_file_t f);
+	unsigned char *psd_mapping(psd_file_t f, size_t *len);
+	unsigned char *psd_readptr(psd_file_t f, size_t n, size_t *got);
+	unsigned char *psd_preadptr(psd_file_t f, size_t n, off_t pos, size_t *got);
+	size_t psd_pread(psd_file_t f, void *ptr, size_t n, off_t pos);
+
+	int psd_fgetc(psd_file_t f);
+	int psd_feof(psd_file_t f);
+	size_t psd_fread(void *ptr, size_t s, size_t n, psd_file_t f);
+	int psd_fseeko(psd_file_t f, off_t pos, int wh);
+	off_t psd_ftello(psd_file_t f);
+
+	int psd_concurrent(psd_file_t f);
+
+	// output files, which remain stdio streams
+	FILE *fopen_out(char *name);
+	int fseeko_out(FILE *f, off_t pos, int wh);
+	off_t ftello_out(FILE *f);
+	size_t fread_out(void *ptr, size_t s, size_t n, FILE *f);
+
 	#define checkmalloc(N) ckmalloc(N, __FILE__, __LINE__)
 #endif
 
@@ -219,6 +345,8 @@ struct psd_header{
 	psd_bytes_t layerdatapos; // set by dopsd()
 	psd_bytes_t global_lmi_pos, global_lmi_len;
 	struct channel_info *merged_chans; // set by doimage()
+	struct psd_arena *arena; // memory for the above (see docmalloc())
+	char indir[PATH_MAX]; // default output directory, set by openfiles()
 };
 
 struct layer_mask_info{
@@ -250,19 +378,51 @@ struct blend_mode_info{
 	//unsigned char filler;
 };
 
+struct channel_group;
+struct row_bands;
+struct zip_stream;
+struct psd_inflater;
+struct psd_arena;
+
+// File positions of the rows of an RLE channel, kept compactly:
+// the position of every ROWSTEP'th row, and the offset of each row
+// (and of the end of the last) from the one before it in that list.
+// Offsets are 16 bits if they all fit, otherwise 32 (a row's data is
+// never more than 2*rowbytes). See rowstart() in channel.c.
+#define ROWSTEP 16
+struct row_index{
+	psd_bytes_t *base;  // rows/ROWSTEP + 1 positions
+	uint16_t *off16;    // rows + 1 offsets, or NULL if
+	uint32_t *off32;    //   they are kept here
+};
+
 struct channel_info{
 	int id;                   // channel id
 	int comptype;             // channel's compression type
 	psd_pixels_t rows, cols, rowbytes;  // set by dochannel()
 	psd_bytes_t length;       // channel byte count in file
+	psd_bytes_t filepos;      // file offset of channel data (set by layeroffsets())
 
 	// used in rebuild
 	psd_bytes_t length_rebuild; // channel byte count in file
 
 	// how to find image data, depending on compression type:
 	psd_bytes_t rawpos;       // file offset of RAW channel data (AFTER compression type)
-	psd_bytes_t *rowpos;      // row data file positions (RLE ONLY)
-	unsigned char *unzipdata; // uncompressed data (ZIP ONLY)
+	struct row_index *rowpos; // row data file positions (RLE ONLY)
+	struct zip_stream *zip;   // inflate state, producing rows on demand (ZIP ONLY)
+
+	struct channel_group *deferred; // non-NULL until prepared (see prepchannel())
+};
+
+// Channels whose preparation was deferred by dochannel(): those
+// sharing one compression type field, i.e. a layer channel,
+// or all channels of the merged image.
+struct channel_group{
+	struct layer_info *li; // NULL for merged image
+	struct psd_header *h;
+	struct channel_info *chan;
+	int channels;
+	int claimed; // set by the thread which prepares it
 };
 
 struct layer_info{
@@ -282,12 +442,67 @@ struct layer_info{
 	char *nameno; // "layerNN"
 	psd_bytes_t additionalpos;
 	psd_bytes_t additionallen;
+	psd_bytes_t imagepos; // file offset of layer's image data (set by layeroffsets())
 
 	psd_bytes_t filepos; // only used in scavenge layers mode
 	psd_bytes_t chpos; // only used in scavenge channels mode
 	psd_bytes_t xcf_pos; // only used by psd2xcf tool
 };
 
+// A block of input, read in one go by cursor_read(), from which
+// big-endian fields are then decoded without further I/O calls.
+// When the input is memory mapped, the block is not copied.
+// All reads are bounds checked: reading past the end of the block
+// sets 'overrun', and gives the same result as get4B() etc. at EOF.
+struct psd_cursor{
+	unsigned char *p, *end; // next byte to read, end of block
+	unsigned char *buf;     // heap copy of block (when not mapped)
+	size_t bufsize;
+	int overrun;
+};
+
+// Levels of task (see pool.c).
+enum{TASK_SHORT, TASK_LAYER, TASK_FILE, TASK_LEVELS};
+
+// A unit of work for the worker pool (see pool.c).
+struct psd_pool;
+struct psd_task{
+	void (*run)(void *arg);
+	void *arg;
+	int level, done;
+	int *pending; // count of unfinished tasks (see pool_track())
+	struct psd_task *next;
+};
+
+// Output made while working on behalf of the main thread (XML, and
+// console messages tagged by stream), kept to be replayed in order.
+struct psd_capture{
+	FILE *xml, *msgs;
+	char *xmlbuf, *msgbuf;
+	size_t xmllen, msglen;
+	FILE *savexml, *savemsgs; // restored by capture_end()
+	struct psd_capture *prev; // capture which this one interrupted
+	int errout; // replay standard output to stderr
+};
+
+// Something held for the file being processed, to be released if a
+// fatal error abandons it (see cleanup_push()).
+struct psd_cleanup{
+	void (*func)(void *arg);
+	void *arg;
+	struct psd_cleanup *next;
+};
+
+// Where to go on a fatal error, instead of ending the program,
+// while a file is processed in --batch (see recover_begin()).
+struct psd_recovery{
+	jmp_buf env;
+	jmp_buf *save;
+	struct psd_capture *capture;
+	struct psd_cleanup *cleanups; // registered before the file
+	int pending, *savepending; // tasks submitted for the file
+};
+
 struct dictentry{
 	int id;
 	char *key, *tag, *desc;
@@ -309,17 +524,54 @@ extern const int mode_colour_space[];
 
 extern char dirsep[], *pngdir;
 extern int verbose, quiet, rsrc, print_rsrc, resdump, extra, makedirs,
-		   numbered, help, split, nwarns, writepng, writelist,
+		   numbered, help, split, writepng, writelist,
 		   writexml, xmlout, unicode_filenames,
-		   rebuild, rebuild_v1, merged_only;
+		   rebuild, rebuild_v1, merged_only, jobs, parallel_layers;
 
-extern FILE *xml, *listfile, *rebuilt_psd;
+extern THREAD_LOCAL FILE *listfile, *rebuilt_psd;
+extern THREAD_LOCAL FILE *xml;
+
+extern THREAD_LOCAL jmp_buf *fatal_jmp;
 
 void fatal(char *s);
+void recover_begin(struct psd_recovery *r);
+void recover_restore(struct psd_recovery *r);
+void recover_end(struct psd_recovery *r);
+void cleanup_push(struct psd_cleanup *c, void (*func)(void *arg), void *arg);
+void cleanup_pop(struct psd_cleanup *c);
 void warn_msg(char *fmt, ...);
+void resetwarns(void);
 void alwayswarn(char *fmt, ...);
+void msgcounts(int *warns, int *errs);
 
 void *ckmalloc(size_t n, char *file, int line);
+void *docmalloc(struct psd_header *h, size_t n);
+void arena_free(struct psd_arena **a);
+void *scratch_get(size_t n);
+void scratch_put(void *p);
+
+extern size_t memlimit;
+int mem_jobs(int jobs);
+int mem_reserve(size_t size, int min, int max);
+void mem_release(size_t size, int n);
+
+#ifdef HAVE_PTHREAD
+int psd_printf(const char *fmt, ...);
+int psd_putchar(int c);
+
+void capture_open(struct psd_capture *c);
+void capture_begin(struct psd_capture *c);
+void capture_end(struct psd_capture *c);
+void capture_replay(struct psd_capture *c);
+#endif
+
+struct psd_pool *pool_get(void);
+void pool_submit(struct psd_pool *p, struct psd_task *t, int level, void (*run)(void *arg), void *arg);
+int pool_done(struct psd_pool *p, struct psd_task *t);
+void pool_wait(struct psd_pool *p, struct psd_task *t);
+int pool_wait_any(struct psd_pool *p, struct psd_task **t, int n);
+int *pool_track(int *count);
+void pool_drain(struct psd_pool *p, int *count);
 
 void fputcxml(char c, FILE *f);
 void fputsxml(char *str, FILE *f);
@@ -334,16 +586,33 @@ int64_t get8B(psd_file_t f);
 int get2B(psd_file_t f);
 unsigned get2Bu(psd_file_t f);
 
-unsigned put4B(psd_file_t f, int32_t);
-unsigned put8B(psd_file_t f, int64_t);
-unsigned putpsdbytes(psd_file_t f, int version, uint64_t value);
-unsigned put2B(psd_file_t f, int);
+unsigned put4B(FILE *f, int32_t);
+unsigned put8B(FILE *f, int64_t);
+unsigned putpsdbytes(FILE *f, int version, uint64_t value);
+unsigned put2B(FILE *f, int);
 
 int32_t peek4B(unsigned char *p);
 int64_t peek8B(unsigned char *p);
 int peek2B(unsigned char *p);
 unsigned peek2Bu(unsigned char *p);
 
+void cursor_init(struct psd_cursor *c);
+size_t cursor_read(psd_file_t f, struct psd_cursor *c, size_t n);
+size_t cursor_pread(psd_file_t f, struct psd_cursor *c, size_t n, off_t pos);
+void cursor_free(struct psd_cursor *c);
+size_t cursor_left(struct psd_cursor *c);
+int curbyte(struct psd_cursor *c);
+size_t curbytes(struct psd_cursor *c, void *dst, size_t n);
+void curskip(struct psd_cursor *c, size_t n);
+int32_t cur4B(struct psd_cursor *c);
+int64_t cur8B(struct psd_cursor *c);
+int cur2B(struct psd_cursor *c);
+unsigned cur2Bu(struct psd_cursor *c);
+int32_t curpeek4B(struct psd_cursor *c, size_t offset);
+int64_t curpeek8B(struct psd_cursor *c, size_t offset);
+int curpeek2B(struct psd_cursor *c, size_t offset);
+unsigned curpeek2Bu(struct psd_cursor *c, size_t offset);
+
 const char *tabs(int n);
 int hexdigit(unsigned char c);
 void openfiles(char *psdpath, struct psd_header *h);
@@ -351,6 +620,8 @@ void openfiles(char *psdpath, struct psd_header *h);
 int dopsd(psd_file_t f, char *fname, struct psd_header *h);
 void processlayers(psd_file_t f, struct psd_header *h);
 void dolayerinfo(psd_file_t f, struct psd_header *h);
+void docfree(struct psd_header *h);
+psd_bytes_t layeroffsets(struct psd_header *h, psd_bytes_t pos);
 
 void entertag(psd_file_t f, int level, int len, struct dictentry *parent, struct dictentry *d, int resetpos);
 struct dictentry *findbykey(psd_file_t f, int level, struct dictentry *dict, char *key, int len, int resetpos);
@@ -378,13 +649,23 @@ void readunpackrow(psd_file_t psd,        // input file handle
 				   psd_pixels_t row,      // row index
 				   unsigned char *inrow,  // dest buffer for the uncompressed row (rb bytes)
 				   unsigned char *outrow); // temporary buffer for compressed data
+void readunpackrows(psd_file_t psd, struct channel_info *chan,
+					psd_pixels_t row, psd_pixels_t nrows,
+					unsigned char *outbuf, unsigned char *rlebuf);
 void dochannel(psd_file_t f,
 		  struct layer_info *li,
 		  struct channel_info *chan, // array of channel info
 		  int channels, // how many channels are to be processed (>1 only for merged data)
 		  struct psd_header *h);
+void prepchannel(psd_file_t f, struct channel_info *chan);
+#ifdef HAVE_PTHREAD
+struct row_bands *bands_open(psd_file_t f, struct psd_pool *pool,
+							 struct channel_info **chan, int channels, psd_pixels_t rows);
+unsigned char *bands_row(struct row_bands *b, int ch, psd_pixels_t row);
+void bands_close(struct row_bands *b);
+#endif
 void doimage(psd_file_t f,struct layer_info *li,char *name,struct psd_header *h);
-void readlayerinfo(psd_file_t f, struct psd_header *h, int i);
+int readlayerinfo(psd_file_t f, struct psd_header *h, int i);
 void dolayermaskinfo(psd_file_t f,struct psd_header *h);
 psd_bytes_t globallayermaskinfo(psd_file_t f, struct psd_header *h);
 void doimageresources(psd_file_t f);
@@ -415,6 +696,7 @@ void rawwriteimage(
 
 // worst case PackBits performance for n bytes:
 #define PACKBITSWORST(n) (129*((n)/128) + 1 + ((n) % 128))
+#define ROWBLOCK 64 // rows per readunpackrows() call, where buffers allow
 psd_pixels_t packbits(unsigned char *src, unsigned char *dst, psd_pixels_t n);
 
 psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
@@ -428,11 +710,16 @@ int is_pdf_delim(char c);
 size_t pdf_string(char **p, char *outbuf, size_t n);
 size_t pdf_name(char **p, char *outbuf, size_t n);
 
-psd_status psd_unzip_without_prediction(psd_uchar *src_buf, psd_int src_len,
-	psd_uchar *dst_buf, psd_int dst_len);
-psd_status psd_unzip_with_prediction(psd_uchar *src_buf, psd_int src_len,
-	psd_uchar *dst_buf, psd_int dst_len,
-	psd_int row_size, psd_int color_depth);
+void psd_unpredict_row(psd_uchar *row, psd_int cols, psd_int depth, psd_uchar *tmp);
+struct zip_stream *psd_zip_open(int depth, psd_bytes_t pos, psd_bytes_t len,
+								psd_bytes_t skip, struct zip_stream *prev);
+psd_bytes_t psd_zip_readrows(psd_file_t f, struct channel_info *chan,
+							 psd_pixels_t row, psd_pixels_t nrows, unsigned char *out);
+struct psd_inflater *psd_inflater_new(void);
+void psd_inflater_free(struct psd_inflater *inf);
+size_t psd_inflate(struct psd_inflater *inf, unsigned char *src, size_t src_len,
+				   unsigned char *dst, size_t dst_len, size_t *produced);
+void psd_zip_close(struct zip_stream *zs);
 
 void duotone_data(psd_file_t f, int level);
 
@@ -22,9 +22,9 @@
 
 #include "psdparse.h"
 
-extern FILE *rebuilt_psd;
+extern THREAD_LOCAL FILE *rebuilt_psd;
 
-void writeheader(psd_file_t out_psd, int version, struct psd_header *h){
+void writeheader(FILE *out_psd, int version, struct psd_header *h){
 	fwrite("8BPS", 1, 4, out_psd);
 	put2B(out_psd, version);
 	put4B(out_psd, PAD_BYTE);
@@ -36,81 +36,259 @@ void writeheader(psd_file_t out_psd, int version, struct psd_header *h){
 	put2B(out_psd, h->mode);
 }
 
-psd_bytes_t writepsdchannels(
+/* Channel compression.
+ * Each channel is PackBits compressed into its own buffer, so that with
+ * --jobs, channels can be compressed on worker threads, ahead of the one
+ * being written. The compressed channels are written in file order;
+ * the messages of each (e.g. warnings about bad data) are replayed
+ * before it is written, as they would appear with one thread.
+ *
+ * So that a large channel (such as the composite of a big PSB) needs no
+ * more memory than a small one, at most PACK_BUFFER bytes of compressed
+ * data are kept in memory (less with a small --memlimit); beyond that,
+ * they are spilled to a temporary file, and copied from there when the
+ * channel is written.
+ */
+
+#define PACK_BUFFER (16L<<20)
+
+// A channel, PackBits compressed in memory (and perhaps a spill file).
+struct packed_chan{
+	struct psd_task task;
+#ifdef HAVE_PTHREAD
+	struct psd_capture out;
+	int captured;
+#endif
+	psd_file_t psd;
+	struct channel_info *ch;
+	uint32_t *rowcounts;
+	unsigned char *compbuf;
+	psd_bytes_t compsize;  // total compressed bytes
+	psd_bytes_t buflen, bufsize; // bytes in compbuf, and its size
+	unsigned char *inrow, *rlebuf; // decoded rows, while compressing
+	FILE *spill;           // compressed bytes before those in compbuf
+	int spillerr;          // compressed data was lost (and is only counted)
+	size_t reserved;       // see mem_reserve()
+	size_t whole;          // reserved for compbuf holding the whole channel
+};
+
+// The size of a channel's compression buffer: enough for the whole
+// channel, if that is no more than PACK_BUFFER.
+
+static psd_bytes_t packbufsize(struct channel_info *ch){
+	psd_bytes_t worst = PACKBITSWORST(ch->rowbytes), size = worst*ch->rows, most = PACK_BUFFER;
+
+	if(memlimit && memlimit/16 < most)
+		most = memlimit/16;
+	if(size > most)
+		size = worst > most ? worst : most;
+	return size;
+}
+
+// Move the compressed data in memory to the spill file, to make room.
+// If there is no spill file to be had, make the buffer big enough
+// for the whole channel instead, if the memory budget allows; otherwise
+// the compressed data is dropped, and the channel will be written raw
+// (see writepacked()).
+
+static void spillpacked(struct packed_chan *pc){
+	struct channel_info *ch = pc->ch;
+	unsigned char *p;
+	size_t whole;
+
+	if(!pc->spillerr && !pc->spill && !(pc->spill = tmpfile())){
+		whole = PACKBITSWORST(ch->rowbytes)*ch->rows;
+		if(mem_reserve(whole, 0, 1)){
+			warn_msg("can't create temporary file, compressing channel in memory");
+			pc->whole = whole;
+			pc->bufsize = whole;
+			p = scratch_get(pc->bufsize);
+			memcpy(p, pc->compbuf, pc->buflen);
+			scratch_put(pc->compbuf);
+			pc->compbuf = p;
+			return;
+		}
+		warn_msg("can't create temporary file, writing channel uncompressed");
+		pc->spillerr = 1;
+	}
+	if(!pc->spillerr && (psd_bytes_t)fwrite(pc->compbuf, 1, pc->buflen, pc->spill) != pc->buflen)
+		pc->spillerr = 1;
+	pc->buflen = 0;
+}
+
+static void packchannel(void *arg){
+	struct packed_chan *pc = arg;
+	struct channel_info *ch = pc->ch;
+	psd_pixels_t j, r, nrows;
+	uint32_t *count;
+	psd_bytes_t worst = PACKBITSWORST(ch->rowbytes);
+
+#ifdef HAVE_PTHREAD
+	if(pc->captured)
+		capture_begin(&pc->out);
+#endif
+
+	// rows are decoded in blocks of up to ROWBLOCK
+	pc->rlebuf = scratch_get(ch->rowbytes*2*ROWBLOCK);
+	pc->inrow  = scratch_get(ch->rowbytes*ROWBLOCK);
+
+	pc->bufsize = packbufsize(ch);
+	pc->compbuf   = scratch_get(pc->bufsize);
+	pc->rowcounts = count = scratch_get(sizeof(uint32_t)*ch->rows);
+	pc->compsize  = pc->buflen = 0;
+	pc->spill = NULL;
+	pc->spillerr = 0;
+	pc->whole = 0;
+	for(j = 0; j < ch->rows; j += nrows){
+		nrows = ch->rows - j < ROWBLOCK ? ch->rows - j : ROWBLOCK;
+		readunpackrows(pc->psd, ch, j, nrows, pc->inrow, pc->rlebuf);
+		for(r = 0; r < nrows; ++r, ++count){
+			if(pc->bufsize - pc->buflen < worst)
+				spillpacked(pc);
+			*count = packbits(pc->inrow + r*ch->rowbytes, pc->compbuf + pc->buflen, ch->rowbytes);
+			pc->compsize += *count;
+			pc->buflen += *count;
+		}
+	}
+
+	scratch_put(pc->rlebuf);
+	scratch_put(pc->inrow);
+	pc->rlebuf = pc->inrow = NULL;
+
+#ifdef HAVE_PTHREAD
+	if(pc->captured)
+		capture_end(&pc->out);
+#endif
+}
+
+// Write a channel's compressed data, copying any spilled part first
+// (through its buffer, which is no longer needed). Return zero if
+// either file had an error.
+
+static int writespilled(struct packed_chan *pc, FILE *out_psd){
+	size_t n;
+
+	if(pc->spill){
+		if(pc->buflen && (psd_bytes_t)fwrite(pc->compbuf, 1, pc->buflen, pc->spill) != pc->buflen)
+			pc->spillerr = 1;
+		rewind(pc->spill);
+		while(!pc->spillerr && (n = fread_out(pc->compbuf, 1, pc->bufsize, pc->spill)))
+			if(fwrite(pc->compbuf, 1, n, out_psd) != n)
+				return 0;
+		return !pc->spillerr && !ferror(pc->spill);
+	}
+	return (psd_bytes_t)fwrite(pc->compbuf, 1, pc->buflen, out_psd) == pc->buflen;
+}
+
+static void freepacked(struct packed_chan *pc, int chancount){
+	int i;
+
+	for(i = 0; i < chancount; ++i){
+		scratch_put(pc[i].compbuf);
+		scratch_put(pc[i].rowcounts);
+		scratch_put(pc[i].inrow);
+		scratch_put(pc[i].rlebuf);
+		if(pc[i].spill)
+			fclose(pc[i].spill);
+		mem_release(pc[i].whole, 1);
+		pc[i].whole = 0;
+		pc[i].compbuf = NULL;
+		pc[i].rowcounts = NULL;
+		pc[i].inrow = pc[i].rlebuf = NULL;
+		pc[i].spill = NULL;
+	}
+}
+
+// Set up a channel to be compressed, holding nothing yet.
+
+static void initpacked(struct packed_chan *pc, psd_file_t psd, struct channel_info *ch){
+	pc->psd = psd;
+	pc->ch = ch;
+#ifdef HAVE_PTHREAD
+	pc->captured = 0;
+#endif
+	pc->compbuf = NULL;
+	pc->rowcounts = NULL;
+	pc->inrow = pc->rlebuf = NULL;
+	pc->spill = NULL;
+	pc->reserved = 0;
+	pc->whole = 0;
+}
+
+// Write one channel, or all channels of the merged image (which share
+// a compression type), from their compressed data. RLE is used if it is
+// a saving, otherwise the rows are decoded again and written raw.
+// Return the number of bytes written.
+
+static psd_bytes_t writepacked(
 		FILE *out_psd,
 		int version,
-		psd_file_t psd,
 		int chindex,
-		struct channel_info *ch,
-		int chancount,
-		struct psd_header *h)
+		struct packed_chan *pc,
+		int chancount)
 {
-	psd_pixels_t j, k, total_rows = chancount * ch->rows;
-	psd_bytes_t *rowcounts;
-	unsigned char *compbuf, *inrow, *rlebuf, *p;
-	int i, comp;
-	psd_bytes_t chansize, compsize;
+	struct channel_info *ch = pc->ch;
+	psd_pixels_t j, nrows, total_rows = chancount * ch->rows;
+	int i, comp, lost = 0;
+	psd_bytes_t chansize, compsize = 0;
 	extern const char *comptype[];
 
-	rlebuf    = checkmalloc(ch->rowbytes*2);
-	inrow     = checkmalloc(ch->rowbytes);
-
-	// compress channel(s) to decide if RLE is a saving
-
-	compbuf   = checkmalloc(PACKBITSWORST(ch->rowbytes)*total_rows);
-	rowcounts = checkmalloc(sizeof(psd_bytes_t)*total_rows);
-
-	p = compbuf;
-	compsize = 0;
-	for(i = k = 0; i < chancount; ++i){
-		for(j = 0; j < ch[i].rows; ++j, ++k){
-			readunpackrow(psd, ch+i, j, inrow, rlebuf);
-			rowcounts[k] = packbits(inrow, p, ch[i].rowbytes);
-			compsize += rowcounts[k];
-			p += rowcounts[k];
-		}
+	for(i = 0; i < chancount; ++i){
+		compsize += pc[i].compsize;
+		lost |= pc[i].spillerr;
 	}
 	// allow for row counts:
 	chansize = (total_rows << version) + compsize;
 
-	if(chansize < total_rows*ch->rowbytes){
+	if(chansize < total_rows*ch->rowbytes && !lost){
 		// RLE was shorter, so use compressed data.
 
 		put2B(out_psd, comp = RLECOMP);
-		for(j = 0; j < total_rows; ++j){
-			if(version == 1){
-				if(rowcounts[j] > UINT16_MAX)
-					fatal("## row count out of range for PSD (v1) format. Try without --rebuildpsd.\n");
-				put2B(out_psd, rowcounts[j]);
-			}else{
-				put4B(out_psd, rowcounts[j]);
+		for(i = 0; i < chancount; ++i)
+			for(j = 0; j < pc[i].ch->rows; ++j){
+				if(version == 1){
+					if(pc[i].rowcounts[j] > UINT16_MAX)
+						fatal("## row count out of range for PSD (v1) format. Try without --rebuildpsd.\n");
+					put2B(out_psd, pc[i].rowcounts[j]);
+				}else{
+					put4B(out_psd, pc[i].rowcounts[j]);
+				}
 			}
-		}
 
-		if((psd_pixels_t)fwrite(compbuf, 1, compsize, out_psd) != compsize){
-			alwayswarn("# error writing psd channel (RLE), aborting\n");
-			return 0;
-		}
+		for(i = 0; i < chancount; ++i)
+			if(!writespilled(pc + i, out_psd)){
+				alwayswarn("# error writing psd channel (RLE), aborting\n");
+				return 0;
+			}
 
-		free(compbuf);
-		free(rowcounts);
+		freepacked(pc, chancount);
 	}else{
-		// There was no saving using RLE, so don't compress.
+		// There was no saving using RLE (or the compressed data
+		// could not be kept), so don't compress.
+
+		freepacked(pc, chancount);
+
+		pc->rlebuf = scratch_get(ch->rowbytes*2*ROWBLOCK);
+		pc->inrow  = scratch_get(ch->rowbytes*ROWBLOCK);
 
 		put2B(out_psd, comp = RAWDATA);
 		chansize = total_rows*ch->rowbytes;
 		for(i = 0; i < chancount; ++i){
-			for(j = 0; j < ch[i].rows; ++j){
+			for(j = 0; j < pc[i].ch->rows; j += nrows){
 				/* get row data */
-				readunpackrow(psd, ch+i, j, inrow, rlebuf);
+				nrows = pc[i].ch->rows - j < ROWBLOCK ? pc[i].ch->rows - j : ROWBLOCK;
+				readunpackrows(pc[i].psd, pc[i].ch, j, nrows, pc->inrow, pc->rlebuf);
 
-				/* write an uncompressed row */
-				if((psd_pixels_t)fwrite(inrow, 1, ch[i].rowbytes, out_psd) != ch[i].rowbytes){
+				/* write uncompressed rows */
+				if((psd_pixels_t)fwrite(pc->inrow, 1, nrows*ch->rowbytes, out_psd) != nrows*ch->rowbytes){
 					alwayswarn("# error writing psd channel (raw), aborting\n");
+					freepacked(pc, 1);
 					return 0;
 				}
 			}
 		}
+
+		freepacked(pc, 1);
 	}
 
 	chansize += 2; // allow for compression type field
@@ -121,12 +299,149 @@ psd_bytes_t writepsdchannels(
 		VERBOSE("#   channel %d: %6u bytes (%s)\n", chindex, (unsigned)chansize, comptype[comp]);
 	}
 
-	free(rlebuf);
-	free(inrow);
+	return chansize;
+}
+
+// The channels being compressed by writepsdchannels() on this thread,
+// released by abandonpacking() when written, or if the file is abandoned.
+static THREAD_LOCAL struct{
+	struct psd_cleanup cleanup;
+	struct packed_chan *pc;
+	int n;
+} packing;
+
+static void abandonpacking(void *arg){
+	freepacked(packing.pc, packing.n);
+	free(packing.pc);
+	packing.pc = NULL;
+}
+
+psd_bytes_t writepsdchannels(
+		FILE *out_psd,
+		int version,
+		psd_file_t psd,
+		int chindex,
+		struct channel_info *ch,
+		int chancount,
+		struct psd_header *h)
+{
+	psd_bytes_t chansize;
+	int i;
+
+	packing.pc = checkmalloc(chancount*sizeof(struct packed_chan));
+	packing.n = chancount;
+	for(i = 0; i < chancount; ++i)
+		initpacked(packing.pc + i, psd, ch + i);
+	cleanup_push(&packing.cleanup, abandonpacking, NULL);
+
+	// compress channel(s) to decide if RLE is a saving
+	for(i = 0; i < chancount; ++i)
+		packchannel(packing.pc + i);
 
+	chansize = writepacked(out_psd, version, chindex, packing.pc, chancount);
+	cleanup_pop(&packing.cleanup);
+	abandonpacking(NULL);
 	return chansize;
 }
 
+#ifdef HAVE_PTHREAD
+
+// How many channels may be compressed ahead of the one being written, per thread.
+#define CHANNELS_IN_FLIGHT 2
+
+// All channels of the rebuilt file, compressed on worker threads.
+struct channel_packer{
+	struct psd_cleanup cleanup; // closes it, if the file is abandoned
+	struct psd_pool *pool;
+	struct packed_chan *pc;
+	int n, next, written;
+};
+
+static void packer_close(struct channel_packer *cp);
+
+static void abandonpacker(void *arg){
+	packer_close(arg);
+}
+
+static struct channel_packer *packer_open(struct psd_pool *pool, psd_file_t psd, struct psd_header *h){
+	struct channel_packer *cp = checkmalloc(sizeof(struct channel_packer));
+	int i, j, k = 0;
+
+	cp->pool = pool;
+	cp->n = cp->next = cp->written = 0;
+	for(i = 0; i < h->nlayers; ++i)
+		cp->n += h->linfo[i].channels;
+	if(h->merged_chans)
+		cp->n += h->channels;
+
+	cp->pc = checkmalloc(cp->n*sizeof(struct packed_chan));
+	for(i = 0; i < h->nlayers; ++i)
+		for(j = 0; j < h->linfo[i].channels; ++j)
+			initpacked(cp->pc + k++, psd, h->linfo[i].chan + j);
+	if(h->merged_chans)
+		for(j = 0; j < h->channels; ++j)
+			initpacked(cp->pc + k++, psd, h->merged_chans + j);
+
+	cleanup_push(&cp->cleanup, abandonpacker, cp);
+	return cp;
+}
+
+// Write the next chancount channels, once compressed, keeping
+// other channels compressing ahead, as far as the memory budget allows.
+
+static psd_bytes_t packer_write(struct channel_packer *cp, FILE *out_psd, int version,
+								int chindex, int chancount)
+{
+	struct channel_info *ch;
+	psd_bytes_t chansize;
+	size_t size;
+	int k, end = cp->written + chancount;
+
+	while(cp->next < cp->n && (cp->next < end || cp->next - cp->written < CHANNELS_IN_FLIGHT*jobs)){
+		ch = cp->pc[cp->next].ch;
+		size = packbufsize(ch) + sizeof(uint32_t)*ch->rows + 3*ROWBLOCK*ch->rowbytes;
+		if(!mem_reserve(size, cp->next < end, 1))
+			break;
+		cp->pc[cp->next].reserved = size;
+		capture_open(&cp->pc[cp->next].out);
+		cp->pc[cp->next].captured = 1;
+		// the channel must be ready before a thread reads it
+		capture_begin(&cp->pc[cp->next].out);
+		prepchannel(cp->pc[cp->next].psd, cp->pc[cp->next].ch);
+		capture_end(&cp->pc[cp->next].out);
+		pool_submit(cp->pool, &cp->pc[cp->next].task, TASK_SHORT, packchannel, cp->pc + cp->next);
+		++cp->next;
+	}
+	for(k = cp->written; k < end; ++k){
+		pool_wait(cp->pool, &cp->pc[k].task);
+		capture_replay(&cp->pc[k].out);
+		cp->pc[k].captured = 0;
+	}
+
+	chansize = writepacked(out_psd, version, chindex, cp->pc + cp->written, chancount);
+	for(k = cp->written; k < end; ++k)
+		mem_release(cp->pc[k].reserved, 1);
+	cp->written = end;
+	return chansize;
+}
+
+static void packer_close(struct channel_packer *cp){
+	cleanup_pop(&cp->cleanup);
+
+	// finish any channels not written (after an error)
+	for(; cp->written < cp->next; ++cp->written){
+		pool_wait(cp->pool, &cp->pc[cp->written].task);
+		if(cp->pc[cp->written].captured)
+			capture_replay(&cp->pc[cp->written].out);
+		mem_release(cp->pc[cp->written].reserved, 1);
+	}
+	freepacked(cp->pc, cp->n);
+	free(cp->pc);
+	free(cp);
+}
+
+#endif
+
 psd_bytes_t writedummymerged(
 		FILE *out_psd,
 		int version,
@@ -152,9 +467,9 @@ psd_bytes_t writedummymerged(
 	return 2 + h->channels * h->rows * rowbytes;
 }
 
-static int32_t bounds_top, bounds_left, bounds_bottom, bounds_right;
+static THREAD_LOCAL int32_t bounds_top, bounds_left, bounds_bottom, bounds_right;
 
-psd_bytes_t writelayerinfo(psd_file_t psd, psd_file_t out_psd,
+psd_bytes_t writelayerinfo(psd_file_t psd, FILE *out_psd,
 						   int version, struct psd_header *h,
 						   psd_pixels_t h_offset, psd_pixels_t v_offset)
 {
@@ -243,17 +558,26 @@ psd_bytes_t writelayerinfo(psd_file_t psd, psd_file_t out_psd,
 	return size;
 }
 
-psd_bytes_t copy_block(psd_file_t psd, psd_file_t out_psd, psd_bytes_t pos){
+#define COPY_CHUNK (1L<<20)
+
+psd_bytes_t copy_block(psd_file_t psd, FILE *out_psd, psd_bytes_t pos){
 	char *tempbuf;
-	psd_bytes_t n, cnt;
+	unsigned char lenbuf[4];
+	psd_bytes_t n, cnt, done, chunk, got;
 
-	fseeko(psd, pos, SEEK_SET);
-	n = get4B(psd); // TODO: sanity check this byte count
-	tempbuf = malloc(n);
-	fread(tempbuf, 1, n, psd);
+	n = psd_pread(psd, lenbuf, 4, pos) == 4 ? (uint32_t)peek4B(lenbuf) : 0; // TODO: sanity check this byte count
 	put4B(out_psd, n);
-	cnt = fwrite(tempbuf, 1, n, out_psd);
-	free(tempbuf);
+
+	// copy in pieces, so that a large block needs no more memory than a small one
+	tempbuf = scratch_get(n < COPY_CHUNK ? n : COPY_CHUNK);
+	for(done = cnt = 0; done < n && cnt == done; done += chunk){
+		chunk = n - done < COPY_CHUNK ? n - done : COPY_CHUNK;
+		got = psd_pread(psd, tempbuf, chunk, pos + 4 + done);
+		if(got < chunk)
+			memset(tempbuf + got, 0, chunk - got); // keep the length written above
+		cnt += fwrite(tempbuf, 1, chunk, out_psd);
+	}
+	scratch_put(tempbuf);
 	if(cnt != n)
 		alwayswarn("# copy_block(): only wrote %d of %d bytes\n", cnt, n);
 	return 4 + cnt;
@@ -264,10 +588,20 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 	int32_t h_offset = 0, v_offset = 0;
 	int i, j;
 	struct layer_info *li;
+#ifdef HAVE_PTHREAD
+	struct psd_pool *pool = pool_get();
+	struct channel_packer *cp = NULL;
+#endif
 
 	if(merged_only)
 		h->nlayers = 0;
 
+#ifdef HAVE_PTHREAD
+	// compress channels in parallel, if they can be read in parallel
+	if(pool && psd_concurrent(psd))
+		cp = packer_open(pool, psd, h);
+#endif
+
 	// File header =====================================================
 	writeheader(rebuilt_psd, version, h);
 
@@ -278,7 +612,7 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 	put4B(rebuilt_psd, 0); // empty for now
 
 	// Layer and mask information ======================================
-	lmipos = ftello(rebuilt_psd);
+	lmipos = ftello_out(rebuilt_psd);
 	putpsdbytes(rebuilt_psd, version, 0); // dummy lmi length
 	lmilen = 0;
 
@@ -297,6 +631,9 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 
 			for(j = 0; j < li->channels; ++j)
 				layerlen += li->chan[j].length_rebuild =
+#ifdef HAVE_PTHREAD
+						cp ? packer_write(cp, rebuilt_psd, version, j, 1) :
+#endif
 						writepsdchannels(rebuilt_psd, version, psd, j, li->chan + j, 1, h);
 		}
 
@@ -314,6 +651,11 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 	// Merged image data ===============================================
 	if(h->merged_chans){
 		UNQUIET("# rebuilding merged image\n");
+#ifdef HAVE_PTHREAD
+		if(cp)
+			packer_write(cp, rebuilt_psd, version, 0, h->channels);
+		else
+#endif
 		writepsdchannels(rebuilt_psd, version, psd, 0, h->merged_chans, h->channels, h);
 	}else{
 		// For some reason, we have no information about the merged image,
@@ -349,17 +691,22 @@ void rebuild_psd(psd_file_t psd, int version, struct psd_header *h){
 		writedummymerged(rebuilt_psd, version, h);
 
 		// fixup header
-		fseeko(rebuilt_psd, 0, SEEK_SET);
+		fseeko_out(rebuilt_psd, 0, SEEK_SET);
 		writeheader(rebuilt_psd, version, h);
 	}
 
+#ifdef HAVE_PTHREAD
+	if(cp)
+		packer_close(cp);
+#endif
+
 	// File complete ===================================================
 
 	// now do fixups for layer info/layer mask info and image data sizes
 
 	if(h->nlayers){
 		// overwrite layer & mask information with fixed-up sizes
-		fseeko(rebuilt_psd, lmipos, SEEK_SET);
+		fseeko_out(rebuilt_psd, lmipos, SEEK_SET);
 		putpsdbytes(rebuilt_psd, version, lmilen + layerlen); // do fixup
 		putpsdbytes(rebuilt_psd, version, layerlen); // do fixup
 		if(writelayerinfo(psd, rebuilt_psd, version, h, h_offset, v_offset) != checklen)
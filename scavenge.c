@@ -19,10 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-
-#ifdef HAVE_ZLIB_H
-	#include "zlib.h"
-#endif
+#include <stddef.h>
 
 #include "psdparse.h"
 
@@ -30,20 +27,46 @@ extern struct dictentry bmdict[];
 
 extern int scavenge, scavenge_rle;
 
-// Search for layer signatures which appear to be followed by valid
-// layer metadata.
-// If li is not NULL, update this array with the layer metadata.
-// Return a count of all possible layers found.
+#define SCAN_CHUNK (16L<<20) // bytes searched by each task
+
+// A possible layer, found by scan().
+
+struct scan_hit{
+	ptrdiff_t filepos;
+	const char *key;
+	int channels;
+	long t, l, b, r;
+};
+
+// One range of the file to search, and the layers found there.
+
+struct scan_chunk{
+	struct psd_task task;
+	unsigned char *addr;
+	size_t len;        // of the whole file
+	size_t start, end; // offsets of signatures to test
+	int psd_version;
+	struct scan_hit *hit;
+	unsigned n, size;
+};
 
-unsigned scan(unsigned char *addr, size_t len, int psd_version, struct layer_info *li)
+// Search for layer signatures (starting in the chunk's range) which
+// appear to be followed by valid layer metadata, and record them.
+// The layer record around a signature may extend outside the range.
+
+static void scan(void *arg)
 {
-	unsigned char *p = addr, *q;
+	struct scan_chunk *sc = arg;
+	unsigned char *p = sc->addr, *q;
 	size_t i;
 	int j, k;
-	unsigned n = 0, ps_ptr_bytes = 2 << psd_version;
+	unsigned ps_ptr_bytes = 2 << sc->psd_version;
 	struct dictentry *de;
+	struct scan_hit *hit;
 
-	for(i = 0; i < len;)
+	// a signature and blend mode key (8 bytes) follow the layer's
+	// bounds and channel table, which must all be within the file
+	for(i = sc->start; i < sc->end && i + 8 <= sc->len;)
 	{
 		if(KEYMATCH((char*)p+i, "8BIM")){
 			i += 4;
@@ -54,7 +77,7 @@ unsigned scan(unsigned char *addr, size_t len, int psd_version, struct layer_inf
 				if(!memcmp(de->key, (char*)p+i, 4)){
 					// found a possible layer blendmode signature
 					// try to guess number of channels
-					for(j = 1; j < 64; ++j){
+					for(j = 1; j < 64 && i >= 4 + j*(ps_ptr_bytes + 2) + 2 + 16; ++j){
 						q = p + i - 4 - j*(ps_ptr_bytes + 2) - 2;
 						if(peek2B(q) == j){
 							long t = peek4B(q-16), l = peek4B(q-12), b = peek4B(q-8), r = peek4B(q-4);
@@ -68,17 +91,22 @@ unsigned scan(unsigned char *addr, size_t len, int psd_version, struct layer_inf
 								}
 								if(k == j){
 									// channel ids were ok. could still be a valid guess...
-									++n;
-									if(li){
-										li->filepos = q - p - 16;
-										++li;
+									if(sc->n == sc->size){
+										sc->size = sc->size ? 2*sc->size : 64;
+										hit = checkmalloc(sc->size*sizeof(struct scan_hit));
+										if(sc->n)
+											memcpy(hit, sc->hit, sc->n*sizeof(struct scan_hit));
+										free(sc->hit);
+										sc->hit = hit;
 									}
-									else
-										VERBOSE("scavenge @ %8td : key: %c%c%c%c  could be %d channel layer: t = %ld, l = %ld, b = %ld, r = %ld\n",
-											   q - p - 16,
-											   de->key[0], de->key[1], de->key[2], de->key[3],
-											   j,
-											   t, l, b, r);
+									hit = sc->hit + sc->n++;
+									hit->filepos = q - p - 16;
+									hit->key = de->key;
+									hit->channels = j;
+									hit->t = t;
+									hit->l = l;
+									hit->b = b;
+									hit->r = r;
 									break;
 								}
 							}
@@ -90,6 +118,55 @@ unsigned scan(unsigned char *addr, size_t len, int psd_version, struct layer_inf
 		}else
 			++i;
 	}
+}
+
+// Search the whole file for possible layers, in chunks on worker threads
+// where available. A signature lies in just one chunk, so the results
+// are simply joined in file order. Return a count of all possible layers,
+// and store their positions in a new linfo array.
+
+static unsigned scan_layers(unsigned char *addr, size_t len, struct psd_header *h)
+{
+	struct psd_pool *pool = pool_get();
+	struct scan_chunk *sc;
+	struct scan_hit *hit;
+	unsigned n = 0, k;
+	size_t i, nchunks = pool ? (len + SCAN_CHUNK - 1)/SCAN_CHUNK : 1;
+
+	if(!nchunks)
+		nchunks = 1;
+	sc = checkmalloc(nchunks*sizeof(struct scan_chunk));
+	for(i = 0; i < nchunks; ++i){
+		sc[i].addr = addr;
+		sc[i].len = len;
+		sc[i].start = i*SCAN_CHUNK;
+		sc[i].end = i == nchunks-1 ? len : (i+1)*SCAN_CHUNK;
+		sc[i].psd_version = h->version;
+		sc[i].hit = NULL;
+		sc[i].n = sc[i].size = 0;
+		pool_submit(pool, &sc[i].task, TASK_SHORT, scan, sc + i);
+	}
+
+	for(i = 0; i < nchunks; ++i){
+		pool_wait(pool, &sc[i].task);
+		n += sc[i].n;
+	}
+
+	h->linfo = n ? docmalloc(h, n*sizeof(struct layer_info)) : NULL;
+	n = 0;
+	for(i = 0; i < nchunks; ++i){
+		for(k = 0, hit = sc[i].hit; k < sc[i].n; ++k, ++hit){
+			VERBOSE("scavenge @ %8td : key: %c%c%c%c  could be %d channel layer: t = %ld, l = %ld, b = %ld, r = %ld\n",
+				   hit->filepos,
+				   hit->key[0], hit->key[1], hit->key[2], hit->key[3],
+				   hit->channels,
+				   hit->t, hit->l, hit->b, hit->r);
+			h->linfo[n++].filepos = hit->filepos;
+		}
+		free(sc[i].hit);
+	}
+	free(sc);
+
 	return n;
 }
 
@@ -161,147 +238,345 @@ for --mergedrows, --mergedcols, --mergedchan, --depth and --mode.\n");
 	}
 }
 
-// Given a starting pointer, determine if it can be inflate'd as ZIP data
-// into a buffer of the expected uncompressed size.
-// Return the compressed byte count if the data inflates without errors,
-// otherwise return NULL.
+/* Channel search.
+ * For each layer we know about, every offset after the previous layer
+ * is a possible start of its channel data. Most offsets are rejected by
+ * cheap tests of the first channel: its compression word, and then its
+ * first RLE count, the zlib header of ZIP data, or the word following
+ * raw data. Survivors are tested fully, which may inflate ZIP channels.
+ * The tests are exactly those of a full check, so the same offsets match.
+ *
+ * With worker threads, the offsets are searched in windows, in parallel.
+ * The first window is small, since undamaged layers follow one another
+ * directly; later windows grow up to SEARCH_WINDOW. The earliest match
+ * is taken, waiting for the windows before it. Once a window finds a
+ * match, the windows after it stop (they check every SEARCH_CHECK
+ * offsets, and before each full test), and no more are started.
+ * Only the windows up to the match are counted in the statistics,
+ * so that they are those of a search in one thread.
+ * Each search slot keeps its inflater and buffer for the whole scan.
+ */
+
+#define SEARCH_FIRST  (4L<<10)
+#define SEARCH_WINDOW (1L<<20)
+#define SEARCH_CHECK  (4L<<10)
+
+// The earliest match known in a layer's search.
+struct search_limit{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+	size_t pos;
+};
+
+struct chan_search{
+	struct psd_task task;
+	unsigned char *addr;
+	size_t len;
+	struct psd_header *h;
+	struct layer_info *li;
+	struct search_limit *limit;
+	size_t from, to;   // offsets to try
+	size_t pos, end;   // match found (pos < to), and the end of its data
+	struct psd_inflater *inf;
+	unsigned char *buf;
+	size_t bufsize;
+	unsigned long tried, inflated; // statistics, for the window
+};
 
-size_t try_inflate(unsigned char *src_buf, size_t src_len,
-				   unsigned char *dst_buf, size_t dst_len)
+static size_t getlimit(struct search_limit *l){
+	size_t pos;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&l->lock);
+#endif
+	pos = l->pos;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&l->lock);
+#endif
+	return pos;
+}
+
+static void setlimit(struct search_limit *l, size_t pos){
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&l->lock);
+#endif
+	if(pos < l->pos)
+		l->pos = pos;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&l->lock);
+#endif
+}
+
+// Cheaply test whether the first channel of li could start at pos.
+
+static int plausible(unsigned char *addr, size_t len, struct psd_header *h,
+					 struct layer_info *li, size_t pos)
 {
-#ifdef HAVE_ZLIB_H
-	z_stream stream;
-	int state;
-
-	memset(&stream, 0, sizeof(z_stream));
-	stream.data_type = Z_BINARY;
-
-	stream.next_in = src_buf;
-	stream.avail_in = src_len;
-	stream.next_out = dst_buf;
-	stream.avail_out = dst_len;
-
-	if(inflateInit(&stream) == Z_OK) {
-		do {
-			state = inflate(&stream, Z_FINISH);
-			//fprintf(stderr,"inflate: state=%d next_in=%p avail_in=%d next_out=%p avail_out=%d\n",
-			//		state, stream.next_in, stream.avail_in, stream.next_out, stream.avail_out);
-			if(state == Z_STREAM_END)
-				return stream.next_in - src_buf;
-		}  while (state == Z_OK && stream.avail_out > 0 && stream.avail_in > 0);
+	size_t p = pos + 2, n, uncompsize = li->chan[0].rows*li->chan[0].rowbytes;
+	int countbytes = 1 << h->version;
+
+	if(!li->channels)
+		return 1;
+	switch(peek2Bu(addr+pos)){
+	case RAWDATA:
+		return p <= len-uncompsize-2 && peek2Bu(addr + p + uncompsize) <= ZIPPREDICT;
+	case RLECOMP:
+		if(!li->chan[0].rows)
+			return 1;
+		if(p > len-countbytes)
+			return 0;
+		n = h->version == 1 ? peek2Bu(addr+p) : (size_t)peek4B(addr+p);
+		return n >= 2 && n <= li->chan[0].rowbytes*2;
+	case ZIPNOPREDICT:
+	case ZIPPREDICT:
+		// deflate method, window <= 32K, header check, no preset dictionary
+		return p < len-2 && (addr[p] & 0x8f) == 0x08
+			   && !(((addr[p] << 8) | addr[p+1]) % 31) && !(addr[p+1] & 0x20);
 	}
-#endif
 	return 0;
 }
 
-// For each layer we know about, search for possible channel data
-// based on pixel dimensions (also using compression type).
-// If a complete set of channels is found, store chpos to indicate this.
+// Fully test whether all channels of the layer start at pos.
+// If so, return the offset following them, otherwise 0.
+
+static size_t trychannels(struct chan_search *s, size_t pos)
+{
+	unsigned char *addr = s->addr;
+	size_t len = s->len, p = pos, n, count, uncompsize;
+	struct layer_info *li = s->li;
+	int j, c, nextcomp, countbytes = 1 << s->h->version;
+
+	for(c = 0; c < li->channels && p < len-2; ++c)
+	{
+		//fprintf(stderr,"scavenge_channels(): ch=%d p=%lu id=%d length=%lld r%ld x c%ld rb=%ld\n",
+		//		c,p,li->chan[c].id,li->chan[c].length,li->chan[c].rows,li->chan[c].cols,li->chan[c].rowbytes);
+
+		p += 2;
+		uncompsize = li->chan[c].rows*li->chan[c].rowbytes;
+		switch(peek2Bu(addr+p-2))
+		{
+		case RAWDATA:
+			if(p > len-uncompsize-2)
+				return 0;
+			nextcomp = peek2Bu(addr + p + uncompsize);
+			if(nextcomp >= RAWDATA && nextcomp <= ZIPPREDICT){
+				count = uncompsize;
+				//VERBOSE("channel %d: possible RAW data @ %lu\n", c, p);
+			}else
+				return 0;
+			break;
+
+		case RLECOMP:
+			count = 0;
+			for(j = li->chan[c].rows; j--; p += countbytes){ // assume PSD for now
+				if(p > len-countbytes)
+					return 0;
+				n = s->h->version == 1 ? peek2Bu(addr+p) : (size_t)peek4B(addr+p);
+				if(n >= 2 && n <= li->chan[c].rowbytes*2){
+					count += n;
+					//VERBOSE("channel %d: possible RLE data @ %lu\n", c, p);
+				}else
+					return 0; // bad RLE count
+			}
+			break;
+
+		case ZIPNOPREDICT:
+		case ZIPPREDICT:
+			++s->inflated;
+			if(!(count = psd_inflate(s->inf, addr+p, len-p, s->buf, uncompsize, NULL)))
+				return 0;
+			break;
+
+		default:
+			return 0;
+		}
+
+		// Likely channel data for this layer was found.
+		p += count;
+	}
+
+	return c == li->channels ? p : 0;
+}
+
+// Search the window of offsets for the first match, unless
+// an earlier window has found one.
+
+static void searchtask(void *arg)
+{
+	struct chan_search *s = arg;
+	size_t pos;
+
+	for(pos = s->from; pos < s->to; ++pos){
+		if((pos - s->from) % SEARCH_CHECK == 0 && getlimit(s->limit) < pos)
+			break;
+		if(plausible(s->addr, s->len, s->h, s->li, pos)){
+			if(getlimit(s->limit) < pos)
+				break;
+			++s->tried;
+			if((s->end = trychannels(s, pos))){
+				setlimit(s->limit, pos);
+				s->pos = pos;
+				return;
+			}
+		}
+	}
+	s->pos = s->to; // no match here, or an earlier window has it
+}
+
+// The most that a full test of the layer's channels at one offset can
+// decode: for each channel, its RLE counts or its inflated data.
+
+static size_t testcost(struct psd_header *h, struct layer_info *li){
+	size_t cost = 0, size, counts;
+	int c;
+
+	for(c = 0; c < li->channels; ++c){
+		size = li->chan[c].rows*li->chan[c].rowbytes;
+		counts = (size_t)li->chan[c].rows << h->version;
+		cost += size > counts ? size : counts;
+	}
+	return cost;
+}
+
+// Find the first offset from 'from' where the layer's channels may be,
+// or return 0. Store the offset following them in *end, and add
+// the search's statistics to *scanned, *tried and *inflated.
+
+static size_t searchlayer(struct psd_pool *pool, struct chan_search *slot, int nslots,
+						  struct layer_info *li, size_t from, size_t *end,
+						  unsigned long *scanned, unsigned long *tried, unsigned long *inflated)
+{
+	size_t next = from, stop = slot->len-2, window = SEARCH_FIRST, found = 0;
+	int first = 0, busy = 0, k;
+
+	if(from >= stop)
+		return 0;
+
+	slot->limit->pos = (size_t)-1; // no window is running yet
+	while(busy || (!found && next < stop)){
+		// keep every slot searching a window, until a match is known
+		while(!found && busy < nslots && next < stop && next < getlimit(slot->limit)){
+			k = (first + busy) % nslots;
+			slot[k].li = li;
+			slot[k].from = next;
+			slot[k].to = next = pool && stop - next > window ? next + window : stop;
+			slot[k].tried = slot[k].inflated = 0;
+			pool_submit(pool, &slot[k].task, TASK_SHORT, searchtask, slot + k);
+			++busy;
+			if(window < SEARCH_WINDOW)
+				window *= 2;
+		}
+
+		// windows are finished in order; the first match is the one wanted
+		pool_wait(pool, &slot[first].task);
+		if(!found){
+			*tried += slot[first].tried;
+			*inflated += slot[first].inflated;
+			if(slot[first].pos < slot[first].to){
+				found = slot[first].pos;
+				*end = slot[first].end;
+			}
+		}
+		first = (first + 1) % nslots;
+		--busy;
+	}
+	*scanned += (found ? found + 1 : stop) - from;
+	return found;
+}
+
+// Search for possible channel data for each layer we know about, based
+// on pixel dimensions (also using compression type). If a complete set
+// of channels is found, store chpos to indicate this.
 
 void scan_channels(unsigned char *addr, size_t len, struct psd_header *h)
 {
-	int i, j, c, rows, cols, comp, nextcomp, countbytes = 1 << h->version;
+	struct psd_pool *pool = pool_get();
+	int i, c, k, nslots;
 	struct layer_info *li = h->linfo;
-	size_t n, lastpos = h->layerdatapos, pos, p, count, uncompsize;
-	unsigned char *buf;
+	struct chan_search *slot;
+	struct search_limit limit;
+	size_t lastpos = h->layerdatapos, pos, end = 0, size, maxsize = 0;
+	unsigned long scanned = 0, tried = 0, inflated = 0, before;
+	double worst = 0; // bytes the full tests could have decoded
 
 	UNQUIET("scan_channels(): starting @ %lu\n", (unsigned long)lastpos);
 
+	// each slot needs room to inflate the largest channel;
+	// search with as many as the memory budget allows
+	for(i = 0; i < h->nlayers; ++i)
+		if(li[i].bottom != li[i].top && li[i].right != li[i].left)
+			for(c = 0; c < li[i].channels; ++c){
+				size = li[i].chan[c].rows*li[i].chan[c].rowbytes;
+				if(size > maxsize)
+					maxsize = size;
+			}
+	nslots = pool ? mem_reserve(maxsize, 1, 2*jobs) : 1;
+	slot = checkmalloc(nslots*sizeof(struct chan_search));
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&limit.lock, NULL);
+#endif
+
+	for(k = 0; k < nslots; ++k){
+		slot[k].addr = addr;
+		slot[k].len = len;
+		slot[k].h = h;
+		slot[k].limit = &limit;
+		slot[k].inf = psd_inflater_new();
+		slot[k].buf = NULL;
+		slot[k].bufsize = 0;
+	}
+
 	for(i = 0; i < h->nlayers; ++i)
 	{
 		UNQUIET("scan_channels(): layer %d, channels: %d\n", i, li[i].channels);
 
 		li[i].chpos = 0;
-		rows = li[i].bottom - li[i].top;
-		cols = li[i].right  - li[i].left;
-		if(rows && cols)
+		if(li[i].bottom != li[i].top && li[i].right != li[i].left)
 		{
-			// scan forward for compression type value
-			for(pos = lastpos; pos < len-2; ++pos)
-			{
-				p = pos;
-				for(c = 0; c < li[i].channels && p < len-2; ++c)
-				{
-					//fprintf(stderr,"scavenge_channels(): layer=%d ch=%d p=%lu id=%d length=%lld r%ld x c%ld rb=%ld\n",
-					//		i,c,p,li[i].chan[c].id,li[i].chan[c].length,li[i].chan[c].rows,li[i].chan[c].cols,li[i].chan[c].rowbytes);
-
-					comp = peek2Bu(addr+p);
-					p += 2;
-					uncompsize = li[i].chan[c].rows*li[i].chan[c].rowbytes;
-					switch(comp)
-					{
-					case RAWDATA:
-						if(p > len-uncompsize-2)
-							goto mismatch;
-						nextcomp = peek2Bu(addr + p + uncompsize);
-						if(nextcomp >= RAWDATA && nextcomp <= ZIPPREDICT){
-							count = uncompsize;
-							//VERBOSE("layer %d channel %d: possible RAW data @ %lu\n", i, c, p);
-						}else
-							goto mismatch;
-						break;
-
-					case RLECOMP:
-						count = 0;
-						for(j = li[i].chan[c].rows; j--; p += countbytes){ // assume PSD for now
-							if(p > len-countbytes)
-								goto mismatch;
-							n = h->version == 1 ? peek2Bu(addr+p) : (size_t)peek4B(addr+p);
-							if(n >= 2 && n <= li[i].chan[c].rowbytes*2){
-								count += n;
-								//VERBOSE("layer %d channel %d: possible RLE data @ %lu\n", i, c, p);
-							}else
-								goto mismatch; // bad RLE count
-						}
-						break;
-
-					case ZIPNOPREDICT:
-					case ZIPPREDICT:
-						//fprintf(stderr,"ZIP comp type seen... rows=%d rb=%d\n",rows,rb);
-						buf = checkmalloc(uncompsize);
-						count = try_inflate(addr+p, len-p, buf, uncompsize);
-						free(buf);
-						if(count)
-							break;
-
-					default:
-						goto mismatch;
+			// room to inflate any channel of this layer
+			for(c = 0; c < li[i].channels; ++c){
+				size = li[i].chan[c].rows*li[i].chan[c].rowbytes;
+				for(k = 0; k < nslots; ++k)
+					if(size > slot[k].bufsize){
+						free(slot[k].buf);
+						slot[k].buf = checkmalloc(slot[k].bufsize = size);
 					}
+			}
 
-					// Likely channel data for this layer was found.
-					p += count;
-				}
-
-				if(c == li[i].channels)
-				{
-					// All channels found. Store location in linfo[]
-					// and allocate array for channel data.
-
-					UNQUIET("scan_channels(): layer %d may be @ %7lu\n", i, (unsigned long)pos);
-					li[i].chpos = pos;
-					lastpos = p; // step past it
-
-					goto next_layer;
-				}
-mismatch:
-				;
+			before = tried;
+			pos = searchlayer(pool, slot, nslots, li + i, lastpos, &end, &scanned, &tried, &inflated);
+			worst += (double)(tried - before)*testcost(h, li + i);
+			if(pos){
+				// All channels found. Store location in linfo[].
+				UNQUIET("scan_channels(): layer %d may be @ %7lu\n", i, (unsigned long)pos);
+				li[i].chpos = pos;
+				lastpos = end; // step past it
 			}
 		}
-next_layer:
-		;
 	}
+
+	for(k = 0; k < nslots; ++k){
+		free(slot[k].buf);
+		psd_inflater_free(slot[k].inf);
+	}
+	free(slot);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&limit.lock);
+#endif
+	if(pool)
+		mem_release(maxsize, nslots);
+
+	// The search's cost is bounded by a cheap check of each offset scanned,
+	// and the most that the full tests of plausible offsets could decode.
+	UNQUIET("scan_channels(): tested %lu offsets fully, inflating %lu times; worst case %lu offsets checked, %.0f bytes decoded\n",
+			tried, inflated, scanned, worst);
 }
 
 unsigned scavenge_psd(void *addr, size_t st_size, struct psd_header *h)
 {
-	// Pass 1: count possible layers
-	h->nlayers = scan(addr, st_size, h->version, NULL);
-	if(h->nlayers){
-		// Pass 2: store layer information in linfo array.
-		if( (h->linfo = checkmalloc(h->nlayers*sizeof(struct layer_info))) )
-			scan(addr, st_size, h->version, h->linfo);
-	}
-	else
+	h->nlayers = scan_layers(addr, st_size, h);
+	if(!h->nlayers)
 		scan_merged(addr, st_size, h);
 
 	if(h->nlayers){
@@ -21,8 +21,59 @@
 
 #include "psdparse.h"
 
-psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
-						psd_pixels_t outlen, psd_pixels_t inlen)
+/* Most PackBits runs are short, so decoding time goes mainly in the
+ * per-run overhead of memset() and memcpy() calls. Where a run is far
+ * enough from the end of both buffers, the vector variants below instead
+ * fill or copy it in whole 16 (SSE2) or 32 (AVX2) byte vectors.
+ * The excess bytes written past the run are overwritten by the runs that
+ * follow; so output beyond the returned count is undefined
+ * (readunpackrow() pads it).
+ *
+ * The variant is chosen at runtime, on first call. Without GCC (or clang)
+ * on x86, only the scalar decoder is built.
+ */
+
+#define MAXRUN 128 // longest run which a flag byte can encode
+
+// Fill or copy len bytes, rounded up to whole vectors of 'chunk' bytes.
+
+static ALWAYS_INLINE void fillrun(unsigned char *outp, int val, psd_pixels_t len, const int chunk){
+#ifdef HAVE_VECTOR_EXT
+	psd_pixels_t k;
+
+	if(chunk == 32){
+		vec32 v = (vec32){0} + (unsigned char)val;
+		for(k = 0; k < len; k += 32)
+			*(vec32*)(outp+k) = v;
+	}else if(chunk == 16){
+		vec16 v = (vec16){0} + (unsigned char)val;
+		for(k = 0; k < len; k += 16)
+			*(vec16*)(outp+k) = v;
+	}else
+#endif
+		memset(outp, val, len);
+}
+
+static ALWAYS_INLINE void copyrun(unsigned char *outp, unsigned char *inp, psd_pixels_t len, const int chunk){
+#ifdef HAVE_VECTOR_EXT
+	psd_pixels_t k;
+
+	if(chunk == 32){
+		for(k = 0; k < len; k += 32)
+			*(vec32*)(outp+k) = *(vec32*)(inp+k);
+	}else if(chunk == 16){
+		for(k = 0; k < len; k += 16)
+			*(vec16*)(outp+k) = *(vec16*)(inp+k);
+	}else
+#endif
+		memcpy(outp, inp, len);
+}
+
+// Decoder shared by all variants. 'chunk' is a constant (0 for scalar).
+
+static ALWAYS_INLINE psd_pixels_t unpack(unsigned char *outp, unsigned char *inp,
+										 psd_pixels_t outlen, psd_pixels_t inlen,
+										 const int chunk)
 {
 	psd_pixels_t i, len;
 	int val;
@@ -43,7 +94,9 @@ psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
 				val = *inp++;
 				--inlen;
 
-				if((i+len) <= outlen)
+				if(chunk && outlen-i >= MAXRUN)
+					fillrun(outp, val, len, chunk);
+				else if((i+len) <= outlen)
 					memset(outp, val, len);
 				else{
 					memset(outp, val, outlen-i); // fill enough to complete row
@@ -56,7 +109,10 @@ psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
 					if(len > inlen)
 						break; // abort - ran out of input data
 					/* copy verbatim run */
-					memcpy(outp, inp, len);
+					if(chunk && outlen-i >= MAXRUN && inlen >= MAXRUN)
+						copyrun(outp, inp, len, chunk);
+					else
+						memcpy(outp, inp, len);
 					inp += len;
 					inlen -= len;
 				}else{
@@ -73,3 +129,62 @@ psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
 		warn_msg("not enough RLE data for row");
 	return i;
 }
+
+static psd_pixels_t unpack_scalar(unsigned char *outp, unsigned char *inp,
+								  psd_pixels_t outlen, psd_pixels_t inlen)
+{
+	return unpack(outp, inp, outlen, inlen, 0);
+}
+
+#ifdef HAVE_VECTOR_EXT
+
+static TARGET_SSE2 psd_pixels_t unpack_sse2(unsigned char *outp, unsigned char *inp,
+											psd_pixels_t outlen, psd_pixels_t inlen)
+{
+	return unpack(outp, inp, outlen, inlen, 16);
+}
+
+static TARGET_AVX2 psd_pixels_t
+unpack_avx2(unsigned char *outp, unsigned char *inp, psd_pixels_t outlen, psd_pixels_t inlen)
+{
+	return unpack(outp, inp, outlen, inlen, 32);
+}
+
+#endif
+
+static psd_pixels_t (*unpack_fn)(unsigned char *outp, unsigned char *inp,
+								 psd_pixels_t outlen, psd_pixels_t inlen);
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Choose the fastest decoder this CPU supports.
+
+static void choose_unpack(void){
+#ifdef HAVE_VECTOR_EXT
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		unpack_fn = unpack_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		unpack_fn = unpack_sse2;
+	else
+#endif
+		unpack_fn = unpack_scalar;
+}
+
+// Decode one row of PackBits data. Returns the number of bytes unpacked,
+// which is less than outlen if input ran short (with a warning).
+// Where the unpacked data would overflow the row, the excess is discarded.
+
+psd_pixels_t unpackbits(unsigned char *outp, unsigned char *inp,
+						psd_pixels_t outlen, psd_pixels_t inlen)
+{
+#ifdef HAVE_PTHREAD
+	pthread_once(&unpack_once, choose_unpack);
+#else
+	if(!unpack_fn)
+		choose_unpack();
+#endif
+	return unpack_fn(outp, inp, outlen, inlen);
+}
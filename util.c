@@ -22,15 +22,29 @@
 #include <errno.h>
 
 #include "psdparse.h"
+
+#ifdef __GLIBC__
+	#include <malloc.h> // for mallopt()
+#endif
 #include "version.h"
 
 #define WARNLIMIT 10
 
 #ifdef HAVE_ICONV_H
-	iconv_t ic = (iconv_t)-1;
+	THREAD_LOCAL iconv_t ic = (iconv_t)-1;
 #endif
 
+static void error(const char *s);
+
+// When set (for each file in --batch), a fatal error goes back here,
+// so that only the file being processed fails (see recover_begin()).
+THREAD_LOCAL jmp_buf *fatal_jmp;
+
 void fatal(char *s){
+	if(fatal_jmp){
+		error(s);
+		longjmp(*fatal_jmp, 1);
+	}
 	fflush(stdout);
 	fputs(s, stderr);
 #ifdef PSDPARSE_PLUGIN
@@ -42,21 +56,82 @@ void fatal(char *s){
 #endif
 }
 
-int nwarns = 0;
+static THREAD_LOCAL int nwarns = 0, totalwarns = 0, totalerrs = 0;
+
+#ifdef HAVE_PTHREAD
+	// When set, console messages are captured here (see capture_begin()).
+	// Each is recorded as a type (see below), its text, and a NUL.
+	static THREAD_LOCAL FILE *console;
+	static THREAD_LOCAL struct psd_capture *capturing; // the capture begun last
+
+	enum{MSG_OUT = 1, MSG_ERR, MSG_WARN, MSG_RESETWARNS};
+
+	static void record(int type, const char *s){
+		fputc(type, console);
+		fputs(s, console);
+		fputc(0, console);
+	}
+#endif
+
+static void errmsg(const char *s){
+	fflush(stdout);
+	fputs(s, stderr);
+}
+
+// Write an error message, unless it is being captured.
+
+static void error(const char *s){
+#ifdef HAVE_PTHREAD
+	if(console){
+		record(MSG_ERR, s);
+		return;
+	}
+#endif
+	++totalerrs;
+	errmsg(s);
+}
+
+// Write a warning, unless too many have been written already.
+// When captured, the limit is applied as the warning is replayed.
+
+static void warning(const char *s){
+	char t[0x220];
+
+#ifdef HAVE_PTHREAD
+	if(console){
+		record(MSG_WARN, s);
+		return;
+	}
+#endif
+	++totalwarns;
+	if(nwarns == WARNLIMIT) errmsg("#   (further warnings suppressed)\n");
+	++nwarns;
+	if(nwarns <= WARNLIMIT){
+		sprintf(t, "#   warning: %s\n", s);
+		errmsg(t);
+	}
+}
 
 void warn_msg(char *fmt, ...){
 	char s[0x200];
 	va_list v;
 
-	if(nwarns == WARNLIMIT) fputs("#   (further warnings suppressed)\n", stderr);
-	++nwarns;
-	if(nwarns <= WARNLIMIT){
-		va_start(v, fmt);
-		vsnprintf(s, 0x200, fmt, v);
-		va_end(v);
-		fflush(stdout);
-		fprintf(stderr, "#   warning: %s\n", s);
+	va_start(v, fmt);
+	vsnprintf(s, 0x200, fmt, v);
+	va_end(v);
+	warning(s);
+}
+
+// Start counting warnings afresh (e.g. for each image written).
+
+void resetwarns(void){
+#ifdef HAVE_PTHREAD
+	if(console){
+		record(MSG_RESETWARNS, "");
+		return;
 	}
+#endif
+	nwarns = 0;
 }
 
 void alwayswarn(char *fmt, ...){
@@ -66,23 +141,429 @@ void alwayswarn(char *fmt, ...){
 	va_start(v, fmt);
 	vsnprintf(s, 0x200, fmt, v);
 	va_end(v);
-	fflush(stdout);
-	fputs(s, stderr);
+	error(s);
+}
+
+// Fetch the numbers of warnings and errors written by this thread
+// since the last call (e.g. for a file's result line in --batch).
+
+void msgcounts(int *warns, int *errs){
+	*warns = totalwarns;
+	*errs = totalerrs;
+	totalwarns = totalerrs = 0;
+}
+
+#ifdef HAVE_PTHREAD
+
+// printf() and putchar() are redirected here (see psdparse.h).
+
+int psd_printf(const char *fmt, ...){
+	va_list v;
+	int n;
+
+	va_start(v, fmt);
+	if(console){
+		fputc(MSG_OUT, console);
+		n = vfprintf(console, fmt, v);
+		fputc(0, console);
+	}else
+		n = vprintf(fmt, v);
+	va_end(v);
+	return n;
+}
+
+int psd_putchar(int c){
+	return psd_printf("%c", c);
 }
 
+// Prepare to capture output. XML is captured only if it is being
+// written by the calling thread.
+
+void capture_open(struct psd_capture *c){
+	c->xml = xml ? open_memstream(&c->xmlbuf, &c->xmllen) : NULL;
+	c->msgs = open_memstream(&c->msgbuf, &c->msglen);
+	c->errout = 0;
+	if(!c->msgs || (xml && !c->xml))
+		fatal("# capture_open(): can't open memory stream\n");
+}
+
+// Send output of the calling thread to the capture,
+// until capture_end(). The thread need not be the one
+// which opened the capture.
+
+void capture_begin(struct psd_capture *c){
+	c->savexml = xml;
+	c->savemsgs = console;
+	c->prev = capturing;
+	xml = c->xml;
+	console = c->msgs;
+	capturing = c;
+}
+
+void capture_end(struct psd_capture *c){
+	xml = c->savexml;
+	console = c->savemsgs;
+	capturing = c->prev;
+}
+
+// Write captured output to the calling thread's XML and console
+// (which may itself be a capture), and release the capture.
+
+void capture_replay(struct psd_capture *c){
+	char *p, *end;
+
+	if(c->xml){
+		fclose(c->xml);
+		if(xml)
+			fwrite(c->xmlbuf, 1, c->xmllen, xml);
+		free(c->xmlbuf);
+	}
+
+	fclose(c->msgs);
+	for(p = c->msgbuf, end = p + c->msglen; p < end; p += strlen(p) + 1){
+		switch(*p++){
+		case MSG_OUT:
+			if(c->errout)
+				errmsg(p);
+			else
+				printf("%s", p);
+			break;
+		case MSG_ERR:  error(p); break;
+		case MSG_WARN: warning(p); break;
+		case MSG_RESETWARNS: resetwarns(); break;
+		}
+	}
+	free(c->msgbuf);
+}
+
+#endif
+
+/* Recovering from a fatal error in --batch.
+ * Before processing a file, recover_begin() sets fatal_jmp to the
+ * caller's r->env, which the caller has then to setjmp(). After a fatal
+ * error, recover_restore() waits for the tasks submitted for the file
+ * (which may be using the document), and ends any captures begun since;
+ * the caller can then close the file's outputs, and go on. Anything else
+ * held for the file (open images, buffers, memory budget) is released
+ * meanwhile by the cleanups registered for it (see cleanup_push()).
+ * A fatal error within a task (see pool.c) still ends the program, as
+ * the task doesn't know how to abandon the file it is part of.
+ */
+
+static THREAD_LOCAL struct psd_cleanup *cleanups; // most recent first
+
+void recover_begin(struct psd_recovery *r){
+	r->save = fatal_jmp;
+#ifdef HAVE_PTHREAD
+	r->capture = capturing;
+#endif
+	fatal_jmp = &r->env;
+	r->cleanups = cleanups;
+	r->pending = 0;
+	r->savepending = pool_track(&r->pending);
+}
+
+void recover_restore(struct psd_recovery *r){
+	struct psd_cleanup *c;
+
+	fatal_jmp = r->save; // an error from here on is not recovered
+	pool_drain(pool_get(), &r->pending);
+	while(cleanups != r->cleanups){
+		c = cleanups;
+		cleanups = c->next;
+		c->func(c->arg);
+	}
+#ifdef HAVE_PTHREAD
+	while(capturing && capturing != r->capture)
+		capture_end(capturing);
+#endif
+}
+
+void recover_end(struct psd_recovery *r){
+	fatal_jmp = r->save;
+	pool_drain(pool_get(), &r->pending); // (none, unless abandoned)
+	pool_track(r->savepending);
+}
+
+// Have func(arg) called, should a fatal error abandon the file being
+// processed by this thread, until cleanup_pop(c). The holder of the
+// resource keeps c, which can't be on the stack, as by then that's gone.
+
+void cleanup_push(struct psd_cleanup *c, void (*func)(void *arg), void *arg){
+	c->func = func;
+	c->arg = arg;
+	c->next = cleanups;
+	cleanups = c;
+}
+
+// Forget a cleanup (usually the most recent), once its resource
+// has been released.
+
+void cleanup_pop(struct psd_cleanup *c){
+	struct psd_cleanup **p;
+
+	for(p = &cleanups; *p; p = &(*p)->next)
+		if(*p == c){
+			*p = c->next;
+			break;
+		}
+}
+
+static int scratch_trim(void);
+
 void *ckmalloc(size_t n, char *file, int line){
 	void *p = malloc(n);
+	if(!p && scratch_trim()) // try again, without this thread's spare buffers
+		p = malloc(n);
 	if(p){
 		//printf("Allocated %d bytes %s %d: %p\n", n, file, line, p);
 		return p;
 	}
 	else{
-		fprintf(stderr, "can't get %ld bytes @ %s:%d\n", n, file, line);
+		char s[0x80];
+
+		sprintf(s, "can't get %ld bytes @ %s:%d\n", (long)n, file, line);
+		if(fatal_jmp)
+			fatal(s); // only the file being processed fails
+		fputs(s, stderr);
 		exit(1);
 	}
 	return NULL;
 }
 
+/* Per-document arena.
+ * Metadata read while parsing a document (layer records, channel
+ * tables, RLE row positions) is allocated from its arena, in large
+ * blocks, rather than piece by piece, and is all released at once
+ * when the document is done (see docfree()). Layers' channels may be
+ * prepared on worker threads, so allocation is locked.
+ */
+
+#define ARENA_BLOCK (64L<<10)
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+struct psd_arena{
+	struct psd_arena *next;
+	size_t used, size;
+};
+
+#ifdef HAVE_PTHREAD
+	static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void *docmalloc(struct psd_header *h, size_t n){
+	struct psd_arena *a;
+	size_t hdr = ARENA_ALIGN(sizeof(struct psd_arena)), size;
+	char *p;
+
+	if(n > (size_t)-1/2){ // a bogus size from a damaged file, which can't be had
+		char s[0x80];
+		sprintf(s, "# can't get %ld bytes for document\n", (long)n);
+		fatal(s);
+		return NULL;
+	}
+	n = ARENA_ALIGN(n);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&arena_lock);
+#endif
+	if(!(a = h->arena) || n > a->size - a->used){
+		// a large request gets a block of its own, behind the current one
+		size = n > ARENA_BLOCK/4 ? n : ARENA_BLOCK;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&arena_lock); // in case allocation fails
+#endif
+		a = checkmalloc(hdr + size);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&arena_lock);
+#endif
+		a->used = 0;
+		a->size = size;
+		if(size == n && h->arena){
+			a->next = h->arena->next;
+			h->arena->next = a;
+		}else{
+			a->next = h->arena;
+			h->arena = a;
+		}
+	}
+	p = (char*)a + hdr + a->used;
+	a->used += n;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&arena_lock);
+#endif
+	return p;
+}
+
+void arena_free(struct psd_arena **a){
+	struct psd_arena *next;
+
+	for(; *a; *a = next){
+		next = (*a)->next;
+		free(*a);
+	}
+}
+
+/* Scratch buffers.
+ * Row, RLE and tile buffers are wanted for a moment, for each channel
+ * of each layer. Rather than allocate them afresh every time, each thread
+ * keeps the buffers it releases, by size class (powers of two), to hand
+ * out again for later layers and files. Buffers are aligned for the
+ * benefit of vectorised loops, and may be released by a thread other
+ * than the one which got them.
+ */
+
+#define SCRATCH_ALIGN 64
+#define SCRATCH_MINSHIFT 12 // smallest class: 4K
+#define SCRATCH_CLASSES 13  // largest class kept: 16M
+#define SCRATCH_KEEP (32L<<20) // at most this much is kept per thread
+
+struct scratch{
+	struct scratch *next; // next in its class's free list
+	void *base;           // as returned by checkmalloc
+	int cls;              // SCRATCH_CLASSES if not to be kept
+};
+
+static THREAD_LOCAL struct scratch *scratch_free[SCRATCH_CLASSES];
+static THREAD_LOCAL size_t scratch_kept;
+
+// Get a buffer of at least n bytes. Release it with scratch_put().
+
+void *scratch_get(size_t n){
+	struct scratch *s;
+	size_t size;
+	char *base, *p;
+	int c;
+
+	for(c = 0, size = 1L << SCRATCH_MINSHIFT; c < SCRATCH_CLASSES && size < n; ++c)
+		size <<= 1;
+	if(c < SCRATCH_CLASSES && (s = scratch_free[c])){
+		scratch_free[c] = s->next;
+		scratch_kept -= size;
+		return s + 1;
+	}
+	if(c == SCRATCH_CLASSES)
+		size = n;
+
+	base = checkmalloc(sizeof(struct scratch) + SCRATCH_ALIGN + size);
+	p = base + sizeof(struct scratch);
+	p += (SCRATCH_ALIGN - (size_t)p % SCRATCH_ALIGN) % SCRATCH_ALIGN;
+	s = (struct scratch*)p - 1;
+	s->base = base;
+	s->cls = c;
+	return p;
+}
+
+void scratch_put(void *p){
+	struct scratch *s;
+	size_t size;
+
+	if(p){
+		s = (struct scratch*)p - 1;
+		size = (1L << SCRATCH_MINSHIFT) << s->cls;
+		if(s->cls < SCRATCH_CLASSES && scratch_kept + size <= SCRATCH_KEEP
+		   && (!memlimit || scratch_kept + size <= memlimit/8/jobs)){
+			s->next = scratch_free[s->cls];
+			scratch_free[s->cls] = s;
+			scratch_kept += size;
+		}else
+			free(s->base);
+	}
+}
+
+// Free the buffers kept by this thread. Returns nonzero if there were any.
+
+static int scratch_trim(void){
+	struct scratch *s;
+	int c, any = scratch_kept != 0;
+
+	for(c = 0; c < SCRATCH_CLASSES; ++c)
+		while((s = scratch_free[c])){
+			scratch_free[c] = s->next;
+			free(s->base);
+		}
+	scratch_kept = 0;
+	return any;
+}
+
+/* Memory budget.
+ * --memlimit puts a hard limit on the address space of the process, so
+ * that beyond it, allocation fails (and checkmalloc() gives up). To keep
+ * clear of it, the number of threads is fitted to the limit, and the
+ * large buffers that are only there for speed (bands of rows, PNG
+ * compression chunks, XCF strips, channels compressed ahead for
+ * --rebuild, scavenging's inflate buffers) are reserved from a budget,
+ * a part of the limit. Where the budget runs short, fewer of them are
+ * used, and work is done with less parallelism, or row by row.
+ *
+ * Memory that is needed in any case is not budgeted: the document's
+ * metadata (including RLE row indexes), the inflate state of ZIP
+ * channels, and the buffers of the one channel or row being worked on.
+ * These are what the other part of the limit is left for; a file
+ * whose metadata alone is too large still fails.
+ */
+
+#define BUDGET_SHARE 2          // the budget is 1/2 of the limit
+#define THREAD_MEMORY (24L<<20) // allowed for each thread's stack and buffers
+
+size_t memlimit = 0; // bytes, or 0 for no limit
+static size_t mem_used;
+
+#ifdef HAVE_PTHREAD
+	static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Return the number of threads that should be used, with the memory limit.
+// Called before any threads are started.
+
+int mem_jobs(int jobs){
+	int n;
+
+	if(!memlimit)
+		return jobs;
+#ifdef M_ARENA_MAX
+	// each malloc arena of a thread reserves address space of its own
+	mallopt(M_ARENA_MAX, 1);
+#endif
+	n = memlimit/BUDGET_SHARE/THREAD_MEMORY;
+	if(jobs > n){
+		jobs = n < 1 ? 1 : n;
+		VERBOSE("# --memlimit: using %d threads\n", jobs);
+	}
+	return jobs;
+}
+
+// Reserve buffers of the given size from the budget: up to max of them,
+// and at least min (even if over budget, so that work can go on).
+// Returns the number reserved, to be released with mem_release().
+
+int mem_reserve(size_t size, int min, int max){
+	int n;
+
+	if(!memlimit)
+		return max;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&mem_lock);
+#endif
+	for(n = 0; n < max && (n < min || mem_used + size <= memlimit/BUDGET_SHARE); ++n)
+		mem_used += size;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&mem_lock);
+#endif
+	return n;
+}
+
+void mem_release(size_t size, int n){
+	if(memlimit){
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&mem_lock);
+#endif
+		mem_used -= size*n;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&mem_lock);
+#endif
+	}
+}
+
 // escape XML special characters to entities
 // see: http://www.w3.org/TR/xml/#sec-predefined-ent
 
@@ -125,7 +606,7 @@ void fwritexml(char *buf, size_t count, FILE *f){
 // N.B. This returns a pointer to the string as a C string (no length
 //      byte, and terminated by NUL).
 char *getpstr(psd_file_t f){
-	static char pstr[0x100];
+	static THREAD_LOCAL char pstr[0x100];
 	int len = fgetc(f);
 	if(len != EOF){
 		fread(pstr, 1, len, f);
@@ -137,7 +618,7 @@ char *getpstr(psd_file_t f){
 
 // Pascal string, padded to multiple of 2 bytes
 char *getpstr2(psd_file_t f){
-	static char pstr[0x100];
+	static THREAD_LOCAL char pstr[0x100];
 	int len = fgetc(f);
 	if(len != EOF){
 		fread(pstr, 1, len, f);
@@ -150,7 +631,7 @@ char *getpstr2(psd_file_t f){
 }
 
 char *getkey(psd_file_t f){
-	static char k[5];
+	static THREAD_LOCAL char k[5];
 	if(fread(k, 1, 4, f) == 4)
 		k[4] = 0;
 	else
@@ -190,54 +671,52 @@ double getdoubleB(psd_file_t f){
 
 // Read a 4-byte signed binary value in BigEndian format.
 // Assumes sizeof(long) == 4 (and two's complement CPU :)
+// Returns -1 at EOF.
 int32_t get4B(psd_file_t f){
-	long n = fgetc(f)<<24;
-	n |= fgetc(f)<<16;
-	n |= fgetc(f)<<8;
-	return n | fgetc(f);
+	unsigned char b[4];
+	return fread(b, 1, 4, f) == 4 ? peek4B(b) : -1;
 }
 
 #ifndef __SC__ // MPW 68K compiler does not support long long
 // Read a 8-byte signed binary value in BigEndian format.
-// Assumes sizeof(long) == 4
+// Returns -1 at EOF.
 int64_t get8B(psd_file_t f){
-	int64_t msl = (unsigned long)get4B(f);
-	return (msl << 32) | (unsigned long)get4B(f);
+	unsigned char b[8];
+	return fread(b, 1, 8, f) == 8 ? peek8B(b) : -1;
 }
 #endif
 
 // Read a 2-byte signed binary value in BigEndian format.
 int get2B(psd_file_t f){
-	unsigned n = fgetc(f)<<8;
-	n |= fgetc(f);
+	unsigned char b[2];
+	unsigned n = fread(b, 1, 2, f) == 2 ? peek2Bu(b) : (unsigned)-1;
 	return n < 0x8000 ? n : n - 0x10000;
 }
 
 // Read a 2-byte unsigned binary value in BigEndian format.
 unsigned get2Bu(psd_file_t f){
-	unsigned n = fgetc(f)<<8;
-	return n |= fgetc(f);
+	unsigned char b[2];
+	return fread(b, 1, 2, f) == 2 ? peek2Bu(b) : (unsigned)-1;
 }
 
-
-unsigned put4B(psd_file_t f, int32_t value){
+unsigned put4B(FILE *f, int32_t value){
 	return fputc(value >> 24, f) != EOF
 		&& fputc(value >> 16, f) != EOF
 		&& fputc(value >>  8, f) != EOF
 		&& fputc(value, f) != EOF;
 }
 
-unsigned put8B(psd_file_t f, int64_t value){
+unsigned put8B(FILE *f, int64_t value){
 	return put4B(f, value >> 32) && put4B(f, value);
 }
 
-unsigned putpsdbytes(psd_file_t f, int version, uint64_t value){
+unsigned putpsdbytes(FILE *f, int version, uint64_t value){
 	if(version == 1 && value > UINT32_MAX)
 		fatal("## Value out of range for PSD format. Try without --rebuildpsd.\n");
 	return version == 1 ? put4B(f, value) : put8B(f, value);
 }
 
-unsigned put2B(psd_file_t f, int value){
+unsigned put2B(FILE *f, int value){
 	return fputc(value >> 8, f) != EOF
 		&& fputc(value, f) != EOF;
 }
@@ -248,26 +727,195 @@ unsigned put2B(psd_file_t f, int value){
 // Read a 4-byte signed binary value in BigEndian format.
 // Assumes sizeof(long) == 4 (and two's complement CPU :)
 int32_t peek4B(unsigned char *p){
+#ifdef BSWAP32
+	uint32_t v;
+	memcpy(&v, p, 4); // p may be unaligned
+	return BSWAP32(v);
+#else
 	return (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+#endif
 }
 
 // Read a 8-byte signed binary value in BigEndian format.
 // Assumes sizeof(long) == 4
 int64_t peek8B(unsigned char *p){
+#ifdef BSWAP64
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return BSWAP64(v);
+#else
 	int64_t msl = (unsigned long)peek4B(p);
 	return (msl << 32) | (unsigned long)peek4B(p+4);
+#endif
 }
 
 // Read a 2-byte signed binary value in BigEndian format.
 // Meant to work even where sizeof(short) > 2
 int peek2B(unsigned char *p){
-	unsigned n = (p[0]<<8) | p[1];
+	unsigned n = peek2Bu(p);
 	return n < 0x8000 ? n : n - 0x10000;
 }
 
 // Read a 2-byte unsigned binary value in BigEndian format.
 unsigned peek2Bu(unsigned char *p){
+#ifdef BSWAP16
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return (uint16_t)BSWAP16(v);
+#else
 	return (p[0]<<8) | p[1];
+#endif
+}
+
+// Cursor over a block of input (see struct psd_cursor).
+// Reads past the end of the block return the same values
+// as get4B() etc. at end of file, and set c->overrun.
+
+void cursor_init(struct psd_cursor *c){
+	c->p = c->end = c->buf = NULL;
+	c->bufsize = 0;
+	c->overrun = 0;
+}
+
+// Read the next n bytes of input into the cursor, replacing any
+// previous block. Returns the number of bytes actually available
+// (fewer than n at end of file). The file is left positioned
+// after the block.
+size_t cursor_read(psd_file_t f, struct psd_cursor *c, size_t n){
+	size_t got;
+#ifndef PSDPARSE_PLUGIN
+	unsigned char *p;
+
+	if( (p = psd_readptr(f, n, &got)) ){
+		// file is in memory, no need to copy
+		c->p = p;
+		c->end = p + got;
+		c->overrun = 0;
+		return got;
+	}
+#endif
+	if(n > c->bufsize){
+		free(c->buf);
+		c->buf = checkmalloc(n);
+		c->bufsize = n;
+	}
+	got = fread(c->buf, 1, n, f);
+	c->p = c->buf;
+	c->end = c->buf + got;
+	c->overrun = 0;
+	return got;
+}
+
+// As cursor_read(), but fetch the n bytes at offset pos, without
+// using or changing the file position (see psd_pread()).
+size_t cursor_pread(psd_file_t f, struct psd_cursor *c, size_t n, off_t pos){
+	size_t got;
+#ifndef PSDPARSE_PLUGIN
+	unsigned char *p;
+
+	if( (p = psd_preadptr(f, n, pos, &got)) ){
+		c->p = p;
+		c->end = p + got;
+		c->overrun = 0;
+		return got;
+	}
+#endif
+	if(n > c->bufsize){
+		free(c->buf);
+		c->buf = checkmalloc(n);
+		c->bufsize = n;
+	}
+	got = psd_pread(f, c->buf, n, pos);
+	c->p = c->buf;
+	c->end = c->buf + got;
+	c->overrun = 0;
+	return got;
+}
+
+void cursor_free(struct psd_cursor *c){
+	free(c->buf);
+	cursor_init(c);
+}
+
+size_t cursor_left(struct psd_cursor *c){
+	return c->end - c->p;
+}
+
+int curbyte(struct psd_cursor *c){
+	if(c->p < c->end)
+		return *c->p++;
+	c->overrun = 1;
+	return EOF;
+}
+
+// Copy up to n bytes; returns number actually copied.
+size_t curbytes(struct psd_cursor *c, void *dst, size_t n){
+	if(n > cursor_left(c)){
+		n = cursor_left(c);
+		c->overrun = 1;
+	}
+	if(n){
+		memcpy(dst, c->p, n);
+		c->p += n;
+	}
+	return n;
+}
+
+void curskip(struct psd_cursor *c, size_t n){
+	if(n > cursor_left(c)){
+		c->p = c->end;
+		c->overrun = 1;
+	}else
+		c->p += n;
+}
+
+int32_t cur4B(struct psd_cursor *c){
+	int32_t v = curpeek4B(c, 0);
+	curskip(c, 4);
+	return v;
+}
+
+#ifndef __SC__
+int64_t cur8B(struct psd_cursor *c){
+	int64_t v = curpeek8B(c, 0);
+	curskip(c, 8);
+	return v;
+}
+#endif
+
+int cur2B(struct psd_cursor *c){
+	int v = curpeek2B(c, 0);
+	curskip(c, 2);
+	return v;
+}
+
+unsigned cur2Bu(struct psd_cursor *c){
+	unsigned v = curpeek2Bu(c, 0);
+	curskip(c, 2);
+	return v;
+}
+
+// Bounds checked peeks, at an offset from the cursor position.
+// The cursor is not moved, and an out of bounds peek does not
+// set overrun.
+
+int32_t curpeek4B(struct psd_cursor *c, size_t offset){
+	return cursor_left(c) >= 4 && offset <= cursor_left(c) - 4 ? peek4B(c->p + offset) : -1;
+}
+
+#ifndef __SC__
+int64_t curpeek8B(struct psd_cursor *c, size_t offset){
+	return cursor_left(c) >= 8 && offset <= cursor_left(c) - 8 ? peek8B(c->p + offset) : -1;
+}
+#endif
+
+int curpeek2B(struct psd_cursor *c, size_t offset){
+	unsigned n = curpeek2Bu(c, offset);
+	return n < 0x8000 ? n : n - 0x10000;
+}
+
+unsigned curpeek2Bu(struct psd_cursor *c, size_t offset){
+	return cursor_left(c) >= 2 && offset <= cursor_left(c) - 2 ? peek2Bu(c->p + offset) : (unsigned)-1;
 }
 
 // return pointer to a string of n tabs
@@ -281,22 +929,22 @@ int hexdigit(unsigned char c){
 	return c - (c >= 'A' ? 'A'-10 : '0');
 }
 
-char indir[PATH_MAX];
-FILE *rebuilt_psd;
+THREAD_LOCAL FILE *rebuilt_psd;
 
 void openfiles(char *psdpath, struct psd_header *h)
 {
-	char *ext, fname[PATH_MAX], *dirsuffix;
+	char *ext, fname[PATH_MAX], *dirsuffix, *dir;
 
-	strcpy(indir, psdpath);
+	strcpy(h->indir, psdpath);
 	dirsuffix = h->depth < 32 ? "_png" : "_raw";
-	if( (ext = strrchr(indir, '.')) )
+	if( (ext = strrchr(h->indir, '.')) )
 		strcpy(ext, dirsuffix);
 	else
-		strcat(indir, dirsuffix);
+		strcat(h->indir, dirsuffix);
+	dir = pngdir ? pngdir : h->indir;
 
 	if(writelist){
-		setupfile(fname, pngdir, "list", ".txt");
+		setupfile(fname, dir, "list", ".txt");
 		listfile = fopen(fname, "w");
 	}else{
 		listfile = NULL;
@@ -304,8 +952,8 @@ void openfiles(char *psdpath, struct psd_header *h)
 
 	if(rebuild){
 		char *basename = strrchr(psdpath, DIRSEP);
-		setupfile(fname, pngdir, basename ? basename : psdpath, "-rebuilt.psd");
-		rebuilt_psd = fopen(fname, "w");
+		setupfile(fname, dir, basename ? basename : psdpath, "-rebuilt.psd");
+		rebuilt_psd = fopen_out(fname);
 	}else{
 		rebuilt_psd = NULL;
 	}
@@ -316,7 +964,7 @@ void openfiles(char *psdpath, struct psd_header *h)
 		verbose = 0;
 		xml = stdout;
 	}else if(writexml){
-		setupfile(fname, pngdir, "psd", ".xml");
+		setupfile(fname, dir, "psd", ".xml");
 		xml = fopen(fname, "w");
 	}else{
 		xml = NULL;
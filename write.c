@@ -107,9 +107,9 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 	// map channel count to a suitable PNG mode (when scavenging and actual mode is not known)
 	static int png_mode[] = {0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
 								PNG_COLOR_TYPE_RGB,  PNG_COLOR_TYPE_RGB_ALPHA};
-	int ch, pngchan = 0, color_type = 0, has_alpha = 0,
+	int ch, pngchan = 0, color_type = 0, has_alpha = 0, splitchans = split,
 		channels = li ? li->channels : h->channels;
-	psd_bytes_t image_data_end;
+	char *dir = pngdir ? pngdir : h->indir;
 
 	if(h->mode == SCAVENGE_MODE){
 		pngchan = channels;
@@ -122,7 +122,7 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 
 		switch(h->mode){
 		default: // multichannel, cmyk, lab etc
-			split = 1;
+			splitchans = 1;
 		case ModeBitmap:
 		case ModeGrayScale:
 		case ModeGray16:
@@ -148,12 +148,14 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 			dochannel(f, li, li->chan + ch, 1/*count*/, h);
 		}
 
-		image_data_end = ftello(f);
+		// The file is now positioned after the layer's image data,
+		// as the caller expects. Image output uses positional reads
+		// only (see readunpackrow()), so does not disturb this.
 
 		if(writepng && !merged_only){
-			nwarns = 0;
-			if(pngchan && !split){
-				writeimage(f, pngdir, name, li, li->chan,
+			resetwarns();
+			if(pngchan && !splitchans){
+				writeimage(f, dir, name, li, li->chan,
 						   h->depth == 32 ? channels : pngchan,
 						   li->bottom - li->top, li->right - li->left,
 						   h, color_type);
@@ -162,17 +164,17 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 					// spit out any 'extra' channels (e.g. layer mask)
 					for(ch = 0; ch < channels; ++ch)
 						if(li->chan[ch].id < -1 || li->chan[ch].id >= pngchan)
-							writechannels(f, pngdir, name, li, li->chan + ch, 1, h);
+							writechannels(f, dir, name, li, li->chan + ch, 1, h);
 				}
 			}
 			else{
 				UNQUIET("# writing layer as split channels...\n");
-				writechannels(f, pngdir, name, li, li->chan, channels, h);
+				writechannels(f, dir, name, li, li->chan, channels, h);
 			}
 		}
 	}
 	else{
-		h->merged_chans = checkmalloc(channels*sizeof(struct channel_info));
+		h->merged_chans = docmalloc(h, channels*sizeof(struct channel_info));
 
 		// The 'merged' or 'composite' image is where the flattened image is stored
 		// when 'Maximise Compatibility' is used.
@@ -190,33 +192,28 @@ void doimage(psd_file_t f, struct layer_info *li, char *name, struct psd_header
 		VERBOSE("\n  merged image:\n");
 		dochannel(f, NULL, h->merged_chans, channels, h);
 
-		image_data_end = ftello(f);
-
 		if(xml)
 			fprintf(xml, "\t<COMPOSITE CHANNELS='%d' HEIGHT='%d' WIDTH='%d'>\n",
 					channels, h->rows, h->cols);
 
-		nwarns = 0;
+		resetwarns();
 		ch = 0;
-		if(pngchan && !split){
-			writeimage(f, pngdir, name, NULL, h->merged_chans,
+		if(pngchan && !splitchans){
+			writeimage(f, dir, name, NULL, h->merged_chans,
 					   h->depth == 32 ? channels : pngchan,
 					   h->rows, h->cols, h, color_type);
 			ch += pngchan;
 		}
 		if(writepng && ch < channels){
-			if(split){
+			if(splitchans){
 				UNQUIET("# writing %s image as split channels...\n", mode_names[h->mode]);
 			}else{
 				UNQUIET("# writing %d extra channels...\n", channels - ch);
 			}
 
-			writechannels(f, pngdir, name, NULL, h->merged_chans + ch, channels - ch, h);
+			writechannels(f, dir, name, NULL, h->merged_chans + ch, channels - ch, h);
 		}
 
 		if(xml) fputs("\t</COMPOSITE>\n", xml);
 	}
-
-	// caller may expect this file position
-	fseeko(f, image_data_end, SEEK_SET);
 }
@@ -27,8 +27,29 @@
 	#include "zlib.h"
 #endif
 
-static png_structp png_ptr;
-static png_infop info_ptr;
+// per thread, as layers may be written in parallel (see processlayers())
+static THREAD_LOCAL png_structp png_ptr;
+static THREAD_LOCAL png_infop info_ptr;
+
+// The rest of the image being written by this thread: its file, and
+// the buffers of pngwriteimage(). Released by pngfinish() when the image
+// is done, or if a fatal error abandons the file.
+static THREAD_LOCAL struct{
+	struct psd_cleanup cleanup;
+	FILE *f; // static, because it might get used post-longjmp()
+	unsigned char *rowbuf, *rledata, *inrows[4];
+} img;
+
+static void pngfinish(void *arg){
+	int ch;
+
+	fclose(img.f);
+	scratch_put(img.rowbuf);
+	scratch_put(img.rledata);
+	for(ch = 0; ch < 4; ++ch)
+		scratch_put(img.inrows[ch]);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+}
 
 // Prepare to write the PNG file. This function:
 // - creates a directory for it, if needed
@@ -50,12 +71,11 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 					int channels, int color_type, struct layer_info *li, struct psd_header *h)
 {
 	char pngname[PATH_MAX], *pngtype = NULL;
-	static FILE *f; // static, because it might get used post-longjmp()
 	png_color *pngpal;
 	int i, n;
-	psd_bytes_t savepos;
+	struct psd_cursor c;
 
-	f = NULL;
+	img.f = NULL;
 	
 	if(width && height){
 		setupfile(pngname, dir, name, ".png");
@@ -85,7 +105,12 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 			return NULL;
 		}
 
-		if( (f = fopen(pngname, "wb")) ){
+		if( (img.f = fopen_out(pngname)) ){
+			img.rowbuf = img.rledata = NULL;
+			for(i = 0; i < 4; ++i)
+				img.inrows[i] = NULL;
+			cleanup_push(&img.cleanup, pngfinish, NULL);
+
 			if(xml){
 				fputs("\t\t<PNG NAME='", xml);
 				fputsxml(name, xml);
@@ -103,12 +128,12 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 			if( !(info_ptr = png_create_info_struct(png_ptr)) || setjmp(png_jmpbuf(png_ptr)) )
 			{ /* If we get here, libpng had a problem */
 				alwayswarn("### pngsetupwrite: Fatal error in libpng\n");
-				fclose(f);
-				png_destroy_write_struct(&png_ptr, &info_ptr);
+				cleanup_pop(&img.cleanup);
+				pngfinish(NULL);
 				return NULL;
 			}
 
-			png_init_io(png_ptr, f);
+			png_init_io(png_ptr, img.f);
 
 			png_set_IHDR(png_ptr, info_ptr, width, height, h->depth, color_type,
 						 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
@@ -117,18 +142,18 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 				png_set_invert_mono(png_ptr);
 			else if(h->mode == ModeIndexedColor){
 				// go get the colour palette
-				savepos = ftello(psd);
-				fseeko(psd, h->colormodepos, SEEK_SET);
-				n = get4B(psd)/3;
+				cursor_init(&c);
+				cursor_pread(psd, &c, 4 + 3*256, h->colormodepos);
+				n = cur4B(&c)/3;
 				if(n > 256){ // sanity check...
 					warn_msg("# more than 256 entries in colour palette! (%d)\n", n);
 					n = 256;
 				}
 				pngpal = checkmalloc(sizeof(png_color)*n);
-				for(i = 0; i < n; ++i) pngpal[i].red   = fgetc(psd);
-				for(i = 0; i < n; ++i) pngpal[i].green = fgetc(psd);
-				for(i = 0; i < n; ++i) pngpal[i].blue  = fgetc(psd);
-				fseeko(psd, savepos, SEEK_SET);
+				for(i = 0; i < n; ++i) pngpal[i].red   = curbyte(&c);
+				for(i = 0; i < n; ++i) pngpal[i].green = curbyte(&c);
+				for(i = 0; i < n; ++i) pngpal[i].blue  = curbyte(&c);
+				cursor_free(&c);
 				png_set_PLTE(png_ptr, info_ptr, pngpal, n);
 				free(pngpal);
 			}
@@ -141,9 +166,466 @@ FILE* pngsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 
 	}else VERBOSE("### won't write empty PNG, skipping\n");
 
-	return f;
+	return img.f;
+}
+
+/* Interleaving of planar channel rows into PNG pixel order.
+ * A kernel is chosen once per image, for its channel count and depth.
+ * The vector kernels handle 2, 3 or 4 channels of 8 or 16 bits,
+ * 16 bytes of each channel at a time; the scalar loops finish the row,
+ * and handle everything else.
+ */
+
+typedef void (*interleave_fn)(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans);
+
+// Interleave n samples of 'chans' channels, 8 bits.
+
+static void interleave8(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	int ch;
+
+	for(i = 0; i < n; ++i)
+		for(ch = 0; ch < chans; ++ch)
+			*out++ = in[ch][i];
+}
+
+// Interleave n samples of 'chans' channels, 16 bits.
+
+static void interleave16(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	int ch;
+	uint16_t *q = (uint16_t*)out;
+
+	for(i = 0; i < n; ++i)
+		for(ch = 0; ch < chans; ++ch)
+			*q++ = ((uint16_t*)in[ch])[i];
+}
+
+#ifdef HAVE_SHUFFLE
+
+// Interleave the samples from index i on, after a vector loop
+// has done the rest. 'out' points at the output for sample i.
+
+static void finish(unsigned char *out, unsigned char **in, psd_pixels_t i, psd_pixels_t n,
+				   int chans, int bytes)
+{
+	unsigned char *rest[4];
+	int ch;
+
+	for(ch = 0; ch < chans; ++ch)
+		rest[ch] = in[ch] + i*bytes;
+	if(bytes == 2)
+		interleave16(out, rest, n-i, chans);
+	else
+		interleave8(out, rest, n-i, chans);
+}
+
+static TARGET_SSE2 void interleave8x2(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	vec16 a, b;
+
+	for(i = 0; n-i >= 16; i += 16, out += 32){
+		a = *(vec16*)(in[0]+i);
+		b = *(vec16*)(in[1]+i);
+		*(vec16*)out      = __builtin_shufflevector(a, b, 0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23);
+		*(vec16*)(out+16) = __builtin_shufflevector(a, b, 8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31);
+	}
+	finish(out, in, i, n, 2, 1);
 }
 
+static TARGET_SSSE3 void interleave8x3(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	vec16 a, b, c;
+
+	// place the samples of a and b, then fill in c's (-1: don't care)
+	for(i = 0; n-i >= 16; i += 16, out += 48){
+		a = *(vec16*)(in[0]+i);
+		b = *(vec16*)(in[1]+i);
+		c = *(vec16*)(in[2]+i);
+		*(vec16*)out = __builtin_shufflevector(
+			__builtin_shufflevector(a, b, 0,16,-1,1,17,-1,2,18,-1,3,19,-1,4,20,-1,5),
+			c, 0,1,16,3,4,17,6,7,18,9,10,19,12,13,20,15);
+		*(vec16*)(out+16) = __builtin_shufflevector(
+			__builtin_shufflevector(a, b, 21,-1,6,22,-1,7,23,-1,8,24,-1,9,25,-1,10,26),
+			c, 0,21,2,3,22,5,6,23,8,9,24,11,12,25,14,15);
+		*(vec16*)(out+32) = __builtin_shufflevector(
+			__builtin_shufflevector(a, b, -1,11,27,-1,12,28,-1,13,29,-1,14,30,-1,15,31,-1),
+			c, 26,1,2,27,4,5,28,7,8,29,10,11,30,13,14,31);
+	}
+	finish(out, in, i, n, 3, 1);
+}
+
+static TARGET_SSE2 void interleave8x4(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	vec16 a, b, c, d;
+	vec16w ab, cd;
+
+	// pair up bytes of a,b and c,d, then pair up those pairs
+	for(i = 0; n-i >= 16; i += 16, out += 64){
+		a = *(vec16*)(in[0]+i);
+		b = *(vec16*)(in[1]+i);
+		c = *(vec16*)(in[2]+i);
+		d = *(vec16*)(in[3]+i);
+
+		ab = (vec16w)__builtin_shufflevector(a, b, 0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23);
+		cd = (vec16w)__builtin_shufflevector(c, d, 0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23);
+		*(vec16*)out      = (vec16)__builtin_shufflevector(ab, cd, 0,8,1,9,2,10,3,11);
+		*(vec16*)(out+16) = (vec16)__builtin_shufflevector(ab, cd, 4,12,5,13,6,14,7,15);
+
+		ab = (vec16w)__builtin_shufflevector(a, b, 8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31);
+		cd = (vec16w)__builtin_shufflevector(c, d, 8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31);
+		*(vec16*)(out+32) = (vec16)__builtin_shufflevector(ab, cd, 0,8,1,9,2,10,3,11);
+		*(vec16*)(out+48) = (vec16)__builtin_shufflevector(ab, cd, 4,12,5,13,6,14,7,15);
+	}
+	finish(out, in, i, n, 4, 1);
+}
+
+static TARGET_SSE2 void interleave16x2(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	vec16w a, b;
+
+	for(i = 0; n-i >= 8; i += 8, out += 32){
+		a = (vec16w)*(vec16*)(in[0]+2*i);
+		b = (vec16w)*(vec16*)(in[1]+2*i);
+		*(vec16*)out      = (vec16)__builtin_shufflevector(a, b, 0,8,1,9,2,10,3,11);
+		*(vec16*)(out+16) = (vec16)__builtin_shufflevector(a, b, 4,12,5,13,6,14,7,15);
+	}
+	finish(out, in, i, n, 2, 2);
+}
+
+static TARGET_SSSE3 void interleave16x3(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	vec16w a, b, c;
+
+	for(i = 0; n-i >= 8; i += 8, out += 48){
+		a = (vec16w)*(vec16*)(in[0]+2*i);
+		b = (vec16w)*(vec16*)(in[1]+2*i);
+		c = (vec16w)*(vec16*)(in[2]+2*i);
+		*(vec16*)out = (vec16)__builtin_shufflevector(
+			__builtin_shufflevector(a, b, 0,8,-1,1,9,-1,2,10), c, 0,1,8,3,4,9,6,7);
+		*(vec16*)(out+16) = (vec16)__builtin_shufflevector(
+			__builtin_shufflevector(a, b, -1,3,11,-1,4,12,-1,5), c, 10,1,2,11,4,5,12,7);
+		*(vec16*)(out+32) = (vec16)__builtin_shufflevector(
+			__builtin_shufflevector(a, b, 13,-1,6,14,-1,7,15,-1), c, 0,13,2,3,14,5,6,15);
+	}
+	finish(out, in, i, n, 3, 2);
+}
+
+static TARGET_SSE2 void interleave16x4(unsigned char *out, unsigned char **in, psd_pixels_t n, int chans){
+	psd_pixels_t i;
+	vec16w a, b, c, d;
+	vec16d ab, cd;
+
+	for(i = 0; n-i >= 8; i += 8, out += 64){
+		a = (vec16w)*(vec16*)(in[0]+2*i);
+		b = (vec16w)*(vec16*)(in[1]+2*i);
+		c = (vec16w)*(vec16*)(in[2]+2*i);
+		d = (vec16w)*(vec16*)(in[3]+2*i);
+
+		ab = (vec16d)__builtin_shufflevector(a, b, 0,8,1,9,2,10,3,11);
+		cd = (vec16d)__builtin_shufflevector(c, d, 0,8,1,9,2,10,3,11);
+		*(vec16*)out      = (vec16)__builtin_shufflevector(ab, cd, 0,4,1,5);
+		*(vec16*)(out+16) = (vec16)__builtin_shufflevector(ab, cd, 2,6,3,7);
+
+		ab = (vec16d)__builtin_shufflevector(a, b, 4,12,5,13,6,14,7,15);
+		cd = (vec16d)__builtin_shufflevector(c, d, 4,12,5,13,6,14,7,15);
+		*(vec16*)(out+32) = (vec16)__builtin_shufflevector(ab, cd, 0,4,1,5);
+		*(vec16*)(out+48) = (vec16)__builtin_shufflevector(ab, cd, 2,6,3,7);
+	}
+	finish(out, in, i, n, 4, 2);
+}
+
+#endif
+
+static interleave_fn choose_interleave(int chans, int depth){
+#ifdef HAVE_SHUFFLE
+	static const interleave_fn vec8[] = {interleave8x2, interleave8x3, interleave8x4},
+							   vec16[] = {interleave16x2, interleave16x3, interleave16x4};
+
+	__builtin_cpu_init();
+	if(chans >= 2 && chans <= 4 && __builtin_cpu_supports("sse2")
+	   && (chans != 3 || __builtin_cpu_supports("ssse3")))
+		return depth == 16 ? vec16[chans-2] : vec8[chans-2];
+#endif
+	return depth == 16 ? interleave16 : interleave8;
+}
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_ZLIB_H)
+
+/* Parallel compression of the image data, in the manner of pigz.
+ * Rows are filtered as they arrive, and collected into chunks which
+ * worker threads deflate independently, each with its window primed
+ * from the end of the previous chunk. Every chunk but the last ends
+ * with a sync flush, so together they make a single zlib stream, whose
+ * check value is combined from theirs. Each chunk is written as an IDAT.
+ */
+
+#define IDAT_CHUNK (256L<<10) // filtered bytes per chunk (at least)
+#define IDAT_DICT  (32L<<10)  // deflate window
+
+struct idat_chunk{
+	struct psd_task task;
+	unsigned char *in, *dict, *out;
+	size_t inlen, dictlen, outlen, outsize;
+	uLong adler;
+	int strategy, first, last, busy, ok;
+};
+
+struct idat_writer{
+	struct psd_cleanup cleanup; // closes it, if the file is abandoned
+	struct psd_pool *pool;
+	png_structp png;
+	size_t rowbytes;
+	int bpp, filter, invert;
+	unsigned char *row, *prev, *trial[4]; // current and previous rows, filter trials
+	struct idat_chunk *chunk; // ring of chunks
+	size_t chunksize;         // memory of each chunk, with its deflate state
+	int nchunks, cur, oldest, started;
+	uLong adler;
+};
+
+static void idat_task(void *arg){
+	struct idat_chunk *c = arg;
+	z_stream z;
+	size_t need;
+	int res;
+
+	c->adler = adler32(adler32(0, NULL, 0), c->in, c->inlen);
+
+	memset(&z, 0, sizeof(z));
+	if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, c->strategy) != Z_OK){
+		c->ok = 0;
+		return;
+	}
+
+	// room for the zlib header, a sync flush, and the check value
+	need = deflateBound(&z, c->inlen) + 32;
+	if(need > c->outsize){
+		scratch_put(c->out);
+		c->out = scratch_get(c->outsize = need);
+	}
+
+	c->outlen = 0;
+	if(c->first){
+		c->out[c->outlen++] = 0x78; // deflate, 32K window
+		c->out[c->outlen++] = 0xda; // maximum compression
+	}
+	if(c->dictlen)
+		deflateSetDictionary(&z, c->dict, c->dictlen);
+
+	z.next_in = c->in;
+	z.avail_in = c->inlen;
+	z.next_out = c->out + c->outlen;
+	z.avail_out = c->outsize - c->outlen - 4;
+	res = deflate(&z, c->last ? Z_FINISH : Z_SYNC_FLUSH);
+	c->ok = c->last ? res == Z_STREAM_END : res == Z_OK && !z.avail_in;
+	c->outlen = z.next_out - c->out;
+
+	deflateEnd(&z);
+}
+
+static void idat_close(struct idat_writer *d);
+
+static void abandonidat(void *arg){
+	idat_close(arg);
+}
+
+// Returns NULL if there is not the memory for two chunks (see --memlimit),
+// in which case libpng should compress the image.
+
+static struct idat_writer *idat_open(struct psd_pool *pool, png_structp png,
+									 size_t rowbytes, int bpp, int filter, int invert)
+{
+	struct idat_writer *d;
+	size_t chunksize = 2*(IDAT_CHUNK + rowbytes) + IDAT_DICT + (256L<<10); // in, out, dict, deflate state
+	int i, n;
+
+	d = checkmalloc(sizeof(struct idat_writer));
+	d->chunk = checkmalloc(sizeof(struct idat_chunk)*2*jobs);
+	if((n = mem_reserve(chunksize, 0, 2*jobs)) < 2){
+		mem_release(chunksize, n);
+		free(d->chunk);
+		free(d);
+		return NULL;
+	}
+
+	d->chunksize = chunksize;
+	d->nchunks = n;
+	d->pool = pool;
+	d->png = png;
+	d->rowbytes = rowbytes;
+	d->bpp = bpp;
+	d->filter = filter;
+	d->invert = invert;
+
+	d->row = d->prev = NULL;
+	for(i = 0; i < 4; ++i)
+		d->trial[i] = NULL;
+	for(i = 0; i < d->nchunks; ++i){
+		d->chunk[i].in = d->chunk[i].dict = d->chunk[i].out = NULL;
+		d->chunk[i].inlen = d->chunk[i].outsize = 0;
+		d->chunk[i].strategy = filter ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+		d->chunk[i].busy = 0;
+	}
+	cleanup_push(&d->cleanup, abandonidat, d);
+
+	d->row = scratch_get(rowbytes);
+	d->prev = scratch_get(rowbytes);
+	memset(d->prev, 0, rowbytes); // the row above the first is taken as zero
+	for(i = 0; i < 4; ++i)
+		d->trial[i] = filter ? scratch_get(rowbytes) : NULL;
+	for(i = 0; i < d->nchunks; ++i){
+		d->chunk[i].in = scratch_get(IDAT_CHUNK + rowbytes + 1);
+		d->chunk[i].dict = scratch_get(IDAT_DICT);
+	}
+	d->cur = d->oldest = d->started = 0;
+	d->adler = adler32(0, NULL, 0);
+	return d;
+}
+
+// Wait for the oldest chunk in progress, and write it.
+
+static void idat_write(struct idat_writer *d){
+	struct idat_chunk *c = d->chunk + d->oldest;
+	unsigned char *p;
+
+	pool_wait(d->pool, &c->task);
+	c->busy = 0;
+	d->oldest = (d->oldest + 1) % d->nchunks;
+	if(!c->ok)
+		png_error(d->png, "deflate failed");
+
+	d->adler = adler32_combine(d->adler, c->adler, c->inlen);
+	if(c->last){
+		p = c->out + c->outlen;
+		p[0] = d->adler >> 24;
+		p[1] = d->adler >> 16;
+		p[2] = d->adler >> 8;
+		p[3] = d->adler;
+		c->outlen += 4;
+	}
+	png_write_chunk(d->png, (png_bytep)"IDAT", c->out, c->outlen);
+}
+
+// Queue the chunk being filled, and start another.
+
+static void idat_submit(struct idat_writer *d, int last){
+	struct idat_chunk *c = d->chunk + d->cur,
+					  *prev = d->chunk + (d->cur + d->nchunks - 1) % d->nchunks;
+
+	c->first = !d->started;
+	c->last = last;
+	c->dictlen = 0;
+	if(d->started){
+		// the previous chunk is not refilled until after this one
+		c->dictlen = prev->inlen < IDAT_DICT ? prev->inlen : IDAT_DICT;
+		memcpy(c->dict, prev->in + prev->inlen - c->dictlen, c->dictlen);
+	}
+	d->started = 1;
+	c->busy = 1;
+	pool_submit(d->pool, &c->task, TASK_SHORT, idat_task, c);
+
+	d->cur = (d->cur + 1) % d->nchunks;
+	if(d->chunk[d->cur].busy)
+		idat_write(d);
+	d->chunk[d->cur].inlen = 0;
+}
+
+static int paeth(int a, int b, int c){
+	int p = b - c, q = a - c, pa = abs(p), pb = abs(q), pc = abs(p + q);
+
+	return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+// Sum of the filtered bytes taken as signed; smaller usually compresses better.
+
+static unsigned long filtersum(unsigned char *p, size_t n){
+	unsigned long sum = 0;
+	size_t i;
+
+	for(i = 0; i < n; ++i)
+		sum += p[i] < 128 ? p[i] : 256 - p[i];
+	return sum;
+}
+
+// Filter a row into the chunk being filled, choosing the filter per row
+// by the minimum sum heuristic (as libpng does), and queue the chunk when full.
+
+static void idat_row(struct idat_writer *d, unsigned char *row){
+	struct idat_chunk *c = d->chunk + d->cur;
+	unsigned char *x = d->row, *p = d->prev, *out = c->in + c->inlen, *best;
+	unsigned long sum, min;
+	size_t i, n = d->rowbytes;
+	size_t a = d->bpp;
+	int k, type;
+
+	if(d->invert)
+		for(i = 0; i < n; ++i)
+			x[i] = ~row[i];
+	else
+		memcpy(x, row, n);
+
+	type = 0;
+	best = x;
+	if(d->filter){
+		for(i = 0; i < n; ++i){
+			d->trial[0][i] = x[i] - (i < a ? 0 : x[i-a]);
+			d->trial[1][i] = x[i] - p[i];
+			d->trial[2][i] = x[i] - (((i < a ? 0 : x[i-a]) + p[i]) >> 1);
+			d->trial[3][i] = x[i] - (i < a ? p[i] : paeth(x[i-a], p[i], p[i-a]));
+		}
+		min = filtersum(x, n);
+		for(k = 0; k < 4; ++k)
+			if((sum = filtersum(d->trial[k], n)) < min){
+				min = sum;
+				type = k + 1;
+				best = d->trial[k];
+			}
+	}
+	*out++ = type;
+	memcpy(out, best, n);
+	c->inlen += n + 1;
+
+	d->row = p;
+	d->prev = x;
+
+	if(c->inlen >= IDAT_CHUNK)
+		idat_submit(d, 0);
+}
+
+// Queue the last chunk, write everything out, and end the PNG.
+
+static void idat_finish(struct idat_writer *d){
+	idat_submit(d, 1);
+	while(d->chunk[d->oldest].busy)
+		idat_write(d);
+	png_write_chunk(d->png, (png_bytep)"IEND", NULL, 0);
+}
+
+// Wait for any chunks still in progress (after an error), and free.
+
+static void idat_close(struct idat_writer *d){
+	int i;
+
+	cleanup_pop(&d->cleanup);
+	for(i = 0; i < d->nchunks; ++i){
+		if(d->chunk[i].busy)
+			pool_wait(d->pool, &d->chunk[i].task);
+		scratch_put(d->chunk[i].in);
+		scratch_put(d->chunk[i].dict);
+		scratch_put(d->chunk[i].out);
+	}
+	free(d->chunk);
+	scratch_put(d->row);
+	scratch_put(d->prev);
+	for(i = 0; i < 4; ++i)
+		scratch_put(d->trial[i]);
+	mem_release(d->chunksize, d->nchunks);
+	free(d);
+}
+
+#endif
+
 void pngwriteimage(
 		FILE *png,
 		psd_file_t psd,
@@ -152,23 +634,32 @@ void pngwriteimage(
 		int chancount,
 		struct psd_header *h)
 {
-	psd_pixels_t i, j;
-	uint16_t *q;
-	unsigned char *rowbuf, *inrows[4], *rledata, *p;
+	psd_pixels_t j;
+	unsigned char *rows[4];
 	int ch, map[4];
+	interleave_fn interleave;
+#ifdef HAVE_PTHREAD
+	struct psd_pool *pool = pool_get();
+	struct channel_info *bandchan[4];
+	struct row_bands *bands = NULL;
+#endif
+#if defined(HAVE_PTHREAD) && defined(HAVE_ZLIB_H)
+	struct idat_writer *idat = NULL;
+	size_t rowlen = chancount > 1 ? chan->rowbytes*chancount : chan->rowbytes;
+#endif
 	
 	if(xml)
 		fprintf(xml, " CHINDEX='%d' />\n", chan->id);
 
 	// buffer used to construct a row interleaving all channels (if required)
-	rowbuf  = checkmalloc(chan->rowbytes*chancount);
+	img.rowbuf  = scratch_get(chan->rowbytes*chancount);
 
 	// a buffer for RLE decompression (if required), we pass this to readunpackrow()
-	rledata = checkmalloc(chan->rowbytes*2);
+	img.rledata = scratch_get(chan->rowbytes*2);
 
 	// row buffers per channel, for reading non-interleaved rows
 	for(ch = 0; ch < chancount; ++ch){
-		inrows[ch] = checkmalloc(chan->rowbytes);
+		img.inrows[ch] = scratch_get(chan->rowbytes);
 		// build mapping so that png channel 0 --> channel with id 0, etc
 		// and png alpha --> channel with id -1
 		map[ch] = li && chancount > 1 ? li->chindex[ch] : ch;
@@ -185,6 +676,24 @@ void pngwriteimage(
 	//for( ch = 0 ; ch < chancount ; ++ch )
 	//	alwayswarn("# channel map[%d] -> %d\n", ch, map[ch]);
 
+	interleave = choose_interleave(chancount, h->depth);
+
+#ifdef HAVE_PTHREAD
+	// decode a large merged image in bands of rows, on worker threads
+	if(!li && pool && chan->rows > ROWBLOCK && psd_concurrent(psd)){
+		for(ch = 0; ch < chancount; ++ch)
+			bandchan[ch] = map[ch] < 0 || map[ch] >= chancount ? NULL : chan + map[ch];
+		bands = bands_open(psd, pool, bandchan, chancount, chan->rows);
+	}
+#endif
+#if defined(HAVE_PTHREAD) && defined(HAVE_ZLIB_H)
+	// compress a large image in chunks, on worker threads;
+	// palette and bitmap rows are not filtered, as libpng does
+	if(pool && chan->rows*(rowlen + 1) >= 2*IDAT_CHUNK)
+		idat = idat_open(pool, png_ptr, rowlen, h->depth < 8 ? 1 : chancount*h->depth/8,
+						 h->depth >= 8 && h->mode != ModeIndexedColor, h->mode == ModeBitmap);
+#endif
+
 	if( setjmp(png_jmpbuf(png_ptr)) )
 	{ /* If we get here, libpng had a problem writing the file */
 		alwayswarn("### pngwriteimage: Fatal error in libpng\n");
@@ -194,37 +703,47 @@ void pngwriteimage(
 	for(j = 0; j < chan->rows; ++j){
 		for(ch = 0; ch < chancount; ++ch){
 			/* get row data */
+			rows[ch] = img.inrows[ch];
 			if(map[ch] < 0 || map[ch] >= chancount){
 				warn_msg("bad map[%d]=%d, skipping a channel", ch, map[ch]);
-				memset(inrows[ch], 0, chan->rowbytes); // zero out the row
-			}else
-				readunpackrow(psd, chan + map[ch], j, inrows[ch], rledata);
+				memset(img.inrows[ch], 0, chan->rowbytes); // zero out the row
+			}
+#ifdef HAVE_PTHREAD
+			else if(bands)
+				rows[ch] = bands_row(bands, ch, j);
+#endif
+			else
+				readunpackrow(psd, chan + map[ch], j, img.inrows[ch], img.rledata);
 		}
 
 		if(chancount > 1){ /* interleave channels */
-			if(h->depth == 8)
-				for(i = 0, p = rowbuf; i < chan->rowbytes; ++i)
-					for(ch = 0; ch < chancount; ++ch)
-						*p++ = inrows[ch][i];
-			else
-				for(i = 0, q = (uint16_t*)rowbuf; i < chan->rowbytes/2; ++i)
-					for(ch = 0; ch < chancount; ++ch)
-						*q++ = ((uint16_t*)inrows[ch])[i];
-
-			png_write_row(png_ptr, rowbuf);
-		}else
-			png_write_row(png_ptr, inrows[0]);
+			interleave(img.rowbuf, rows, h->depth == 16 ? chan->rowbytes/2 : chan->rowbytes, chancount);
+			rows[0] = img.rowbuf;
+		}
+#if defined(HAVE_PTHREAD) && defined(HAVE_ZLIB_H)
+		if(idat)
+			idat_row(idat, rows[0]);
+		else
+#endif
+			png_write_row(png_ptr, rows[0]);
 	}
 	
-	png_write_end(png_ptr, NULL /*info_ptr*/);
+#if defined(HAVE_PTHREAD) && defined(HAVE_ZLIB_H)
+	if(idat)
+		idat_finish(idat);
+	else
+#endif
+		png_write_end(png_ptr, NULL /*info_ptr*/);
 
 err:
-	fclose(png);
-
-	free(rowbuf);
-	free(rledata);
-	for(ch = 0; ch < chancount; ++ch)
-		free(inrows[ch]);
-
-	png_destroy_write_struct(&png_ptr, &info_ptr);
+#ifdef HAVE_PTHREAD
+	if(bands)
+		bands_close(bands);
+#endif
+#if defined(HAVE_PTHREAD) && defined(HAVE_ZLIB_H)
+	if(idat)
+		idat_close(idat);
+#endif
+	cleanup_pop(&img.cleanup);
+	pngfinish(NULL);
 }
@@ -25,6 +25,21 @@
 
 /* This code could also be used as a template for other file types. */
 
+// The image being written by this thread: its file, and the buffers of
+// rawwriteimage(). Released by rawfinish() when the image is done,
+// or if a fatal error abandons the file.
+static THREAD_LOCAL struct{
+	struct psd_cleanup cleanup;
+	FILE *f;
+	unsigned char *inrow, *rlebuf;
+} img;
+
+static void rawfinish(void *arg){
+	fclose(img.f);
+	scratch_put(img.rlebuf);
+	scratch_put(img.inrow);
+}
+
 FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, psd_pixels_t height, 
 					int channels, int color_type, struct layer_info *li, struct psd_header *h)
 {
@@ -47,7 +62,11 @@ FILE* rawsetupwrite(psd_file_t psd, char *dir, char *name, psd_pixels_t width, p
 
 		// now write the raw binary
 		setupfile(rawname, dir, name, ".raw");
-		if( (f = fopen(rawname, "wb")) ){
+		if( (f = fopen_out(rawname)) ){
+			img.f = f;
+			img.inrow = img.rlebuf = NULL;
+			cleanup_push(&img.cleanup, rawfinish, NULL);
+
 			if(xml){
 				fputs("\t\t\t<RAW NAME='", xml);
 				fputsxml(name, xml);
@@ -74,28 +93,54 @@ void rawwriteimage(
 		struct psd_header *h)
 {
 	psd_pixels_t j;
-	unsigned char *inrow, *rlebuf;
+	unsigned char *row;
 	int i;
+#ifdef HAVE_PTHREAD
+	struct psd_pool *pool = pool_get();
+	struct channel_info *bandchan;
+	struct row_bands *bands = NULL;
+#endif
 
-	rlebuf = checkmalloc(chan->rowbytes*2);
-	inrow  = checkmalloc(chan->rowbytes);
+	img.rlebuf = scratch_get(chan->rowbytes*2);
+	img.inrow  = scratch_get(chan->rowbytes);
 
 	// write channels in a series of planes, not interleaved
 	for(i = 0; i < chancount; ++i){
 		UNQUIET("## rawwriteimage: channel %d\n", i);
+#ifdef HAVE_PTHREAD
+		// decode a large merged image in bands of rows, on worker threads
+		if(!li && pool && chan[i].rows > ROWBLOCK && psd_concurrent(psd)){
+			bandchan = chan + i;
+			bands = bands_open(psd, pool, &bandchan, 1, chan[i].rows);
+		}
+#endif
 		for(j = 0; j < chan[i].rows; ++j){
 			/* get row data */
-			readunpackrow(psd, chan, j, inrow, rlebuf);
-			if((psd_pixels_t)fwrite(inrow, 1, chan[i].rowbytes, raw) != chan->rowbytes){
+			row = img.inrow;
+#ifdef HAVE_PTHREAD
+			if(bands)
+				row = bands_row(bands, 0, j);
+			else
+#endif
+			readunpackrow(psd, chan + i, j, img.inrow, img.rlebuf);
+			if((psd_pixels_t)fwrite(row, 1, chan[i].rowbytes, raw) != chan[i].rowbytes){
 				alwayswarn("# error writing raw data, aborting\n");
 				goto err;
 			}
 		}
+#ifdef HAVE_PTHREAD
+		if(bands){
+			bands_close(bands);
+			bands = NULL;
+		}
+#endif
 	}
 
 err:
-	fclose(raw);
-	free(rlebuf);
-	free(inrow);
+#ifdef HAVE_PTHREAD
+	if(bands)
+		bands_close(bands);
+#endif
+	cleanup_pop(&img.cleanup);
+	rawfinish(NULL);
 }
-
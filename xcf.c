@@ -60,7 +60,7 @@ FILE *xcf_open(char *psd_name, struct psd_header *h){
 	else
 		strcat(fname, xcf_ext);
 
-	if( (xcf = fopen(fname, "wb")) ){
+	if( (xcf = fopen_out(fname)) ){
 		fputs("gimp xcf ", xcf); // File type magic
 		fputs("v001", xcf);      // version
 		fputc(0, xcf);           // Zero-terminator for version tag
@@ -112,14 +112,13 @@ size_t putsxcf(FILE *f, char *s){
 #define CTABSIZE 0x300
 
 // FIXME: add proper return results
-void xcf_prop_colormap(FILE *xcf, FILE *psd, struct psd_header *h){
+void xcf_prop_colormap(FILE *xcf, psd_file_t psd, struct psd_header *h){
 	size_t len;
 	int i, entries = CTABSIZE/3;
 	unsigned char ctab[CTABSIZE];
 
-	fseeko(psd, h->colormodepos, SEEK_SET);
-	len = get4B(psd);
-	if(len == CTABSIZE && fread(ctab, 1, CTABSIZE, psd) == CTABSIZE){
+	len = psd_pread(psd, ctab, 4, h->colormodepos) == 4 ? peek4B(ctab) : 0;
+	if(len == CTABSIZE && psd_pread(psd, ctab, CTABSIZE, h->colormodepos + 4) == CTABSIZE){
 		put4xcf(xcf, PROP_COLORMAP);
 		put4xcf(xcf, 4 + CTABSIZE);
 		put4xcf(xcf, entries);
@@ -299,12 +298,14 @@ void xcf_prop_end(FILE *xcf){
  */
 
 // based on http://telegraphics.com.au/svn/macpaintformat/trunk/packbits.c
-size_t xcf_rle(FILE *xcf, unsigned char *src, size_t n){
-	unsigned char *p, *run, *end;
-	int count, maxrun, out;
+// Compress n bytes into dst (which must have room for XCF_RLEWORST(n)),
+// and return the compressed length.
+size_t xcf_rle(unsigned char *dst, unsigned char *src, size_t n){
+	unsigned char *p, *run, *end, *out = dst;
+	int count, maxrun;
 
 	end = src + n;
-	for(run = src, out = 0; n > 0; run = p, n -= count){
+	for(run = src; n > 0; run = p, n -= count){
 		// longest run possible from here
 		maxrun = n < 0xffff ? n : 0xffff;
 
@@ -314,18 +315,14 @@ size_t xcf_rle(FILE *xcf, unsigned char *src, size_t n){
 
 		// only a run of 3 equal bytes is worth compressing
 		if(count >= 3){
-			if(count <= 127){
-				fputc(count-1, xcf);
-				++out;
-			}
+			if(count <= 127)
+				*out++ = count-1;
 			else{
-				fputc(127, xcf);
-				fputc(count >> 8, xcf);
-				fputc(count, xcf);
-				out += 3;
+				*out++ = 127;
+				*out++ = count >> 8;
+				*out++ = count;
 			}
-			fputc(run[0], xcf);
-			++out;
+			*out++ = run[0];
 		}else{
 			// three equal bytes marks the end of a 'verbatim' run,
 			// because then we must switch to a compressed run
@@ -335,20 +332,72 @@ size_t xcf_rle(FILE *xcf, unsigned char *src, size_t n){
 
 			count = p-run;
 			if(count > 127){
-				fputc(128, xcf);
-				fputc(count >> 8, xcf);
-				fputc(count, xcf);
-				out += 3;
-			}
-			else{
-				fputc(256-count, xcf);
-				++out;
+				*out++ = 128;
+				*out++ = count >> 8;
+				*out++ = count;
 			}
-			fwrite(run, 1, count, xcf);
+			else
+				*out++ = 256-count;
+			memcpy(out, run, count);
 			out += count;
 		}
 	}
-	return out;
+	return out - dst;
+}
+
+#define XCF_TILE 64
+
+/* Tiles are compressed a strip (a row of tiles) at a time, into memory.
+ * With --jobs, strips are compressed on worker threads, while the next
+ * strips are read; they are written to the file in order.
+ */
+
+// How many strips may be in progress at once, per thread.
+#define STRIPS_IN_FLIGHT 2
+
+struct xcf_strip{
+	struct psd_task task;
+	int w, tileh, channel_cnt, compr;
+	struct channel_info **xcf_chan;
+	unsigned char *chan_data[4]; // up to 64 rows of each mapped channel
+	unsigned char *out;          // compressed tiles
+	size_t *tile_end;            // offset in out following each tile
+};
+
+static void xcf_strip(void *arg){
+	struct xcf_strip *st = arg;
+	unsigned char tilebuf[XCF_TILE*XCF_TILE], *dst, *src, *out = st->out;
+	int i, j, ch, xtile, tilew, tile_idx, w = st->w, tileh = st->tileh;
+
+	for(xtile = tile_idx = 0; xtile < w; xtile += XCF_TILE){
+		tilew = (w - xtile) > XCF_TILE ? XCF_TILE : w - xtile;
+
+		// Tiles may be RLE compressed, or uncompressed.
+		if(st->compr){
+			for(ch = 0; ch < st->channel_cnt; ++ch)
+				if(st->xcf_chan[ch]){
+					// Tile data is concatenation of channels (planar),
+					// but each channel is a separate RLE "stream".
+					for(j = 0, dst = tilebuf, src = st->chan_data[ch] + xtile;
+						j < tileh;
+						++j, dst += tilew, src += w)
+					{
+						memcpy(dst, src, tilew);
+					}
+					out += xcf_rle(out, tilebuf, tileh*tilew);
+				}
+		}
+		else{
+			// raw data, without compression (channels are interleaved)
+			for(j = 0; j < tileh; ++j)
+				for(i = 0; i < tilew; ++i)
+					for(ch = 0; ch < st->channel_cnt; ++ch)
+						if(st->xcf_chan[ch])
+							*out++ = st->chan_data[ch][j*w + xtile + i];
+		}
+
+		st->tile_end[tile_idx++] = out - st->out;
+	}
 }
 
 /*
@@ -360,89 +409,96 @@ size_t xcf_rle(FILE *xcf, unsigned char *src, size_t n){
 802	  uint32   0      A zero marks the end of the array of tile pointers
  */
 
-#define XCF_TILE 64
-
-off_t xcf_level(FILE *xcf, FILE *psd, int w, int h,
+off_t xcf_level(FILE *xcf, psd_file_t psd, int w, int h,
 				int channel_cnt, struct channel_info *xcf_chan[], int compr)
 {
-	unsigned char *chan_data[4], *rlebuf, *tilebuf, *dst, *src;
-	int i, j, ch, xtile, ytile, tilew, tileh, ntiles = 0, tile_idx;
-	off_t lptr, *tile_pos = NULL;
-
-	if(xcf_chan){
-		// break data into tiles up to 64x64 wide
-
-		ntiles = ((w+XCF_TILE-1)/XCF_TILE) * ((h+XCF_TILE-1)/XCF_TILE);
+	struct psd_pool *pool = pool_get();
+	struct xcf_strip *strip = NULL, *st;
+	unsigned char *rlebuf;
+	int i, ch, ytile, ntiles = 0, xtiles, tile_idx = 0, nstrips, nslots = 0, next, done;
+	off_t lptr, pos, *tile_pos = NULL;
+	size_t outsize = 0, stripsize = 0;
+
+	// break data into tiles up to 64x64 wide
+
+	xtiles = (w+XCF_TILE-1)/XCF_TILE;
+	nstrips = (h+XCF_TILE-1)/XCF_TILE;
+	if(xcf_chan && (ntiles = xtiles * nstrips)){
 		tile_pos = checkmalloc(sizeof(off_t)*ntiles);
 
-		// need space for 64 rows of each mapped channel
-		for(ch = 0; ch < 4; ++ch)
+		// room for a strip of tiles, compressed or not
+		for(ch = 0; ch < channel_cnt; ++ch)
 			if(xcf_chan[ch])
-				chan_data[ch] = checkmalloc(XCF_TILE*w);
+				outsize += compr ? xtiles*XCF_RLEWORST(XCF_TILE*XCF_TILE) : XCF_TILE*w;
+
+		nslots = pool ? STRIPS_IN_FLIGHT*jobs : 1;
+		if(nslots > nstrips)
+			nslots = nstrips;
+		stripsize = outsize + channel_cnt*XCF_TILE*w;
+		nslots = mem_reserve(stripsize, 1, nslots);
+		strip = checkmalloc(nslots*sizeof(struct xcf_strip));
+		for(i = 0; i < nslots; ++i){
+			strip[i].w = w;
+			strip[i].channel_cnt = channel_cnt;
+			strip[i].compr = compr;
+			strip[i].xcf_chan = xcf_chan;
+			for(ch = 0; ch < 4; ++ch)
+				strip[i].chan_data[ch] = ch < channel_cnt && xcf_chan[ch] ? scratch_get(XCF_TILE*w) : NULL;
+			strip[i].out = scratch_get(outsize);
+			strip[i].tile_end = checkmalloc(xtiles*sizeof(size_t));
+		}
 
-		rlebuf = checkmalloc(2*w);
-		tilebuf = checkmalloc(XCF_TILE*XCF_TILE);
+		rlebuf = scratch_get(2*w);
 
 		// Break image into tiles, top-to-bottom, left-to-right,
 		// where each tile is no larger than XCF_TILE.
 
-		tile_idx = 0;
-		for(ytile = 0; ytile < h; ytile += XCF_TILE){
-			tileh = (h - ytile) > XCF_TILE ? XCF_TILE : h - ytile;
-
-			// read the next 64 row strip from each channel
-			for(ch = 0; ch < channel_cnt; ++ch){
-				if(xcf_chan[ch]){
-					for(i = 0; i < tileh; ++i){
-						readunpackrow(psd,          // input file
-									  xcf_chan[ch], // pointer to channel information
-									  ytile+i,      // row index
-									  chan_data[ch] + i*w,  // destination buffer
-									  rlebuf);      // temporary decompression buffer
-					}
-				}
-			}
-
-			for(xtile = 0; xtile < w; xtile += XCF_TILE){
-				tilew = (w - xtile) > XCF_TILE ? XCF_TILE : w - xtile;
-
-				tile_pos[tile_idx++] = ftello(xcf);
-
-				// Tiles may be RLE compressed, or uncompressed.
-				if(compr){
-					for(ch = 0; ch < channel_cnt; ++ch)
-						if(xcf_chan[ch]){
-							// Tile data is concatenation of channels (planar),
-							// but each channel is a separate RLE "stream".
-							for(j = 0, dst = tilebuf, src = chan_data[ch] + xtile;
-								j < tileh;
-								++j, dst += tilew, src += w)
-							{
-								memcpy(dst, src, tilew);
-							}
-							xcf_rle(xcf, tilebuf, tileh*tilew);
+		for(next = done = 0; done < nstrips;){
+			if(next < nstrips && next - done < nslots){
+				st = strip + next % nslots;
+				ytile = next*XCF_TILE;
+				st->tileh = (h - ytile) > XCF_TILE ? XCF_TILE : h - ytile;
+
+				// read the next 64 row strip from each channel
+				for(ch = 0; ch < channel_cnt; ++ch){
+					if(xcf_chan[ch]){
+						for(i = 0; i < st->tileh; ++i){
+							readunpackrow(psd,          // input file
+										  xcf_chan[ch], // pointer to channel information
+										  ytile+i,      // row index
+										  st->chan_data[ch] + i*w,  // destination buffer
+										  rlebuf);      // temporary decompression buffer
 						}
-				}
-				else{
-					// raw data, without compression (channels are interleaved)
-					for(j = 0; j < tileh; ++j)
-						for(i = 0; i < tilew; ++i)
-							for(ch = 0; ch < channel_cnt; ++ch)
-								if(xcf_chan[ch])
-									fputc(chan_data[ch][j*w + xtile + i], xcf);
+					}
 				}
 
+				pool_submit(pool, &st->task, TASK_SHORT, xcf_strip, st);
+				++next;
+			}else{
+				// write the earliest strip
+				st = strip + done % nslots;
+				pool_wait(pool, &st->task);
+
+				pos = ftello_out(xcf);
+				for(i = 0; i < xtiles; ++i)
+					tile_pos[tile_idx++] = pos + (i ? st->tile_end[i-1] : 0);
+				fwrite(st->out, 1, st->tile_end[xtiles-1], xcf);
+				++done;
 			}
 		}
 
-		for(ch = 0; ch < 4; ++ch)
-			if(xcf_chan[ch])
-				free(chan_data[ch]);
-		free(tilebuf);
-		free(rlebuf);
+		for(i = 0; i < nslots; ++i){
+			for(ch = 0; ch < 4; ++ch)
+				scratch_put(strip[i].chan_data[ch]);
+			scratch_put(strip[i].out);
+			free(strip[i].tile_end);
+		}
+		free(strip);
+		scratch_put(rlebuf);
+		mem_release(stripsize, nslots);
 	}
 
-	lptr = ftello(xcf);
+	lptr = ftello_out(xcf);
 
 	VERBOSE("xcf_level @ %ld w:%4d h:%4d channels:%d compr:%d\n",
 			(long)lptr, w, h, channel_cnt, compr);
@@ -474,7 +530,7 @@ off_t xcf_level(FILE *xcf, FILE *psd, int w, int h,
 767	  uint32   0       A zero ends the list of level pointers
  */
 
-off_t xcf_hierarchy(FILE *xcf, FILE *psd, int w, int h,
+off_t xcf_hierarchy(FILE *xcf, psd_file_t psd, int w, int h,
 					int channel_cnt, struct channel_info *chan[], int compr){
 	int n_levels, j, hh, ww;
 	off_t hptr, level_ptrs[32];
@@ -486,7 +542,7 @@ off_t xcf_hierarchy(FILE *xcf, FILE *psd, int w, int h,
 	for(n_levels = 1, hh = h, ww = w; hh >= 64 || ww >= 64; ++n_levels)
 		level_ptrs[n_levels] = xcf_level(xcf, NULL, ww /= 2, hh /= 2, 0, NULL, compr);
 
-	hptr = ftello(xcf);
+	hptr = ftello_out(xcf);
 	VERBOSE("xcf_hierarchy @ %ld w:%d h:%d channels:%d\n", (long)hptr, w, h, channel_cnt);
 	put4xcf(xcf, w);
 	put4xcf(xcf, h);
@@ -512,11 +568,11 @@ off_t xcf_hierarchy(FILE *xcf, FILE *psd, int w, int h,
 707	  uint32  hptr   Pointer to the hierarchy structure containing the pixels
  */
 
-off_t xcf_channel(FILE *xcf, FILE *psd, int w, int h, char *name, int visible,
+off_t xcf_channel(FILE *xcf, psd_file_t psd, int w, int h, char *name, int visible,
 				  struct channel_info *chan, int compr){
 	off_t hptr = xcf_hierarchy(xcf, psd, w, h, 1, &chan, compr), chptr;
 
-	chptr = ftello(xcf);
+	chptr = ftello_out(xcf);
 	VERBOSE("xcf_channel @ %ld w:%d h:%d visible:%d \"%s\"\n",
 			(long)chptr, w, h, visible, name);
 	put4xcf(xcf, w);
@@ -577,7 +633,7 @@ static const char *xcf_modes[] = {
 	NULL
 };
 
-off_t xcf_layer(FILE *xcf, FILE *psd, struct layer_info *li, int compr)
+off_t xcf_layer(FILE *xcf, psd_file_t psd, struct layer_info *li, int compr)
 {
 	struct channel_info *xcf_chan[4] = {NULL, NULL, NULL, NULL};
 	off_t hptr, lmptr = 0, layerptr;
@@ -619,7 +675,7 @@ off_t xcf_layer(FILE *xcf, FILE *psd, struct layer_info *li, int compr)
 		//					"Layer mask", &li->chan[ch], compr);
 	}
 
-	layerptr = ftello(xcf);
+	layerptr = ftello_out(xcf);
 	ltype = xcf_mode*2 + has_alpha;
 	VERBOSE("xcf_layer @ %ld type:%d \"%s\"\n", (long)layerptr, ltype, li->name);
 	put4xcf(xcf, w);